@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -23,33 +23,237 @@
 #include "fs.h"
 #include "buf.h"
 
-struct {
-  struct spinlock lock;
-  struct buf buf[NBUF];
+#define NBUCKET 127     // prime; about 16 buffers a chain at NBUFMAX
+#define NBUFPG  (PGSIZE / BSIZE)        // buffers sharing one page of data
+#define NGROUP  (NBUFMAX / NBUFPG)      // pages of buffers, at most
+#define NGROUPMIN ((NBUF + NBUFPG - 1) / NBUFPG) // pages that are never given back
+
+// The cache grows by a page of buffers at a time, rather than
+// recycling one, while more than BHIGH pages of physical memory
+// are free. While fewer than BLOW are free, or when kalloc()
+// runs out, it gives pages of free buffers back.
+#define BHIGH   2048
+#define BLOW    1024
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+// The cache is a hash table on (dev, blockno). Each bucket has
+// its own lock and a circular list of the buffers that hash
+// to it, through prev/next. A free buffer (refcnt == 0) stays
+// in its bucket, so that it is found again if its block is
+// read before the buffer is recycled.
+//
+// No code ever holds two bucket locks at once. To recycle a
+// buffer from another bucket, bget() detaches it under that
+// bucket's lock alone, and then moves it to the right bucket.
+//
+// Buffer headers are static, but their data lives in pages
+// from kalloc(), NBUFPG buffers to a page: buf[g*NBUFPG] up to
+// buf[(g+1)*NBUFPG-1] share page[g]. The buffers of a page
+// that is not allocated are in no bucket.
+struct {
+  struct buf buf[NBUFMAX];
+  struct spinlock lock;   // protects page[] and nbuf
+  char *page[NGROUP];
+  int nbuf;
+  struct {
+    struct spinlock lock;
+    struct buf head;
+    uint hits;
+    uint misses;
+  } bucket[NBUCKET];
 } bcache;
 
+static uint
+bhash(uint dev, uint blockno)
+{
+  return (dev * 31 + blockno) % NBUCKET;
+}
+
+static void
+bunlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+  b->bucket = -1;
+}
+
+// Put b on bucket i's list. Caller must hold its lock.
+static void
+blink(int i, struct buf *b)
+{
+  struct buf *head = &bcache.bucket[i].head;
+
+  b->next = head->next;
+  b->prev = head;
+  head->next->prev = b;
+  head->next = b;
+  b->bucket = i;
+}
+
+// Give b an identity that no lookup matches. It then belongs
+// in any bucket.
+static void
+bforget(struct buf *b)
+{
+  b->dev = 0;
+  b->blockno = 0;
+  b->valid = 0;
+}
+
+// Allocate a page of data for a new group of buffers. Put all
+// but one of them, free, in bucket h, and return the last one,
+// in no bucket. Returns 0 if there is no memory or no room.
+static struct buf*
+bgrow(uint h)
+{
+  struct buf *b;
+  char *page;
+  int g, i;
+
+  if((page = kalloc()) == 0)
+    return 0;
+  acquire(&bcache.lock);
+  for(g = 0; g < NGROUP; g++)
+    if(bcache.page[g] == 0)
+      break;
+  if(g == NGROUP){
+    release(&bcache.lock);
+    kfree(page);
+    return 0;
+  }
+  bcache.page[g] = page;
+  bcache.nbuf += NBUFPG;
+  release(&bcache.lock);
+
+  acquire(&bcache.bucket[h].lock);
+  for(i = 0; i < NBUFPG; i++){
+    b = &bcache.buf[g*NBUFPG + i];
+    b->data = (uchar*)page + i*BSIZE;
+    b->refcnt = 0;
+    b->lastuse = 0;
+    bforget(b);
+    if(i < NBUFPG-1)
+      blink(h, b);
+  }
+  release(&bcache.bucket[h].lock);
+  return b;
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  int i;
 
   initlock(&bcache.lock, "bcache");
-
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  for(i = 0; i < NBUCKET; i++){
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+    bcache.bucket[i].head.prev = &bcache.bucket[i].head;
+    bcache.bucket[i].head.next = &bcache.bucket[i].head;
+  }
+  for(b = bcache.buf; b < bcache.buf+NBUFMAX; b++){
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->bucket = -1;
+  }
+  for(i = 0; i < NGROUPMIN; i++){
+    if((b = bgrow(0)) == 0)
+      panic("binit");
+    acquire(&bcache.bucket[0].lock);
+    blink(0, b);
+    release(&bcache.bucket[0].lock);
+  }
+}
+
+// Find the least recently used free buffer in bucket i,
+// take it out of the bucket, and return it, or return 0.
+static struct buf*
+bsteal(int i)
+{
+  struct buf *b, *lru = 0;
+
+  acquire(&bcache.bucket[i].lock);
+  for(b = bcache.bucket[i].head.next; b != &bcache.bucket[i].head; b = b->next)
+    if(b->refcnt == 0 && !b->disk && (lru == 0 || b->lastuse < lru->lastuse))
+      lru = b;
+  if(lru)
+    bunlink(lru);
+  release(&bcache.bucket[i].lock);
+  return lru;
+}
+
+// Take every buffer of group g out of its bucket, if all of
+// them are free. Returns 1 if it did, 0 if some buffer is in use.
+static int
+bdetach(int g)
+{
+  struct buf *b, *first = &bcache.buf[g*NBUFPG];
+  int i;
+
+  for(b = first; b < first + NBUFPG; b++){
+    i = b->bucket;
+    if(i < 0)
+      goto undo;
+    acquire(&bcache.bucket[i].lock);
+    if(b->bucket != i || b->refcnt != 0 || b->disk){
+      release(&bcache.bucket[i].lock);
+      goto undo;
+    }
+    bunlink(b);
+    release(&bcache.bucket[i].lock);
+  }
+  return 1;
+
+ undo:
+  // the block of a buffer that was out of its bucket may
+  // have been cached in another buffer meanwhile.
+  while(--b >= first){
+    bforget(b);
+    acquire(&bcache.bucket[0].lock);
+    blink(0, b);
+    release(&bcache.bucket[0].lock);
+  }
+  return 0;
+}
+
+// Give up to n pages of free buffers back to kalloc().
+// The first NBUF buffers always stay. Returns the number
+// of pages freed. Called by kalloc() when memory runs out,
+// so it must not allocate.
+int
+bshrink(int n)
+{
+  char *page;
+  int g, freed = 0;
+
+  for(g = NGROUP-1; g >= NGROUPMIN && freed < n; g--){
+    if(bcache.page[g] == 0 || !bdetach(g))
+      continue;
+    acquire(&bcache.lock);
+    page = bcache.page[g];
+    bcache.page[g] = 0;
+    bcache.nbuf -= NBUFPG;
+    release(&bcache.lock);
+    kfree(page);
+    freed++;
   }
+  return freed;
+}
+
+// Find a buffer to hold a block that hashes to bucket h: a new
+// one if memory is plentiful, or else the least recently used
+// free buffer of bucket h, or of the nearest bucket that has
+// one. The buffer is in no bucket. Returns 0 if there is none.
+static struct buf*
+balloc(uint h)
+{
+  struct buf *b = 0;
+
+  if(kfreepages() > BHIGH)
+    b = bgrow(h);
+  for(int i = 0; i < NBUCKET && b == 0; i++)
+    b = bsteal((h + i) % NBUCKET);
+  if(b == 0)
+    b = bgrow(h);
+  return b;
 }
 
 // Look through buffer cache for block on device dev.
@@ -58,34 +262,110 @@ binit(void)
 static struct buf*
 bget(uint dev, uint blockno)
 {
-  struct buf *b;
+  struct buf *b, *victim = 0;
+  uint h = bhash(dev, blockno);
 
-  acquire(&bcache.lock);
+  for(;;){
+    acquire(&bcache.bucket[h].lock);
 
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+    // Is the block already cached?
+    for(b = bcache.bucket[h].head.next; b != &bcache.bucket[h].head; b = b->next){
+      if(b->dev == dev && b->blockno == blockno){
+        b->refcnt++;
+        if(victim){
+          // someone else cached it while we looked for a
+          // buffer. keep the spare one here, free.
+          bforget(victim);
+          blink(h, victim);
+        } else {
+          bcache.bucket[h].hits++;
+        }
+        release(&bcache.bucket[h].lock);
+        acquiresleep(&b->lock);
+        return b;
+      }
+    }
+
+    if(victim){
+      victim->dev = dev;
+      victim->blockno = blockno;
+      victim->valid = 0;
+      victim->refcnt = 1;
+      blink(h, victim);
+      bcache.bucket[h].misses++;
+      release(&bcache.bucket[h].lock);
+      acquiresleep(&victim->lock);
+      if(kfreepages() < BLOW)
+        bshrink(1);
+      return victim;
+    }
+    release(&bcache.bucket[h].lock);
+
+    // Not cached. Find a buffer, and then look again: the
+    // block may have been cached while no lock was held.
+    if((victim = balloc(h)) == 0)
+      panic("bget: no buffers");
+  }
+}
+
+// Start reading a block into the cache in the background,
+// unless it is cached already. The buffer stays free while the
+// read is in flight, with b->disk set so that it is not
+// recycled; bread() waits for the read to finish.
+// Returns 0, or -1 if no buffer was free.
+int
+bprefetch(uint dev, uint blockno)
+{
+  struct buf *b;
+  uint h = bhash(dev, blockno);
+
+  acquire(&bcache.bucket[h].lock);
+  for(b = bcache.bucket[h].head.next; b != &bcache.bucket[h].head; b = b->next){
     if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      release(&bcache.bucket[h].lock);
+      return 0;
     }
   }
+  release(&bcache.bucket[h].lock);
+
+  if((b = balloc(h)) == 0)
+    return -1;
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  acquire(&bcache.bucket[h].lock);
+  for(struct buf *b1 = bcache.bucket[h].head.next; b1 != &bcache.bucket[h].head; b1 = b1->next){
+    if(b1->dev == dev && b1->blockno == blockno){
+      bforget(b);
+      blink(h, b);
+      release(&bcache.bucket[h].lock);
+      return 0;
     }
   }
-  panic("bget: no buffers");
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->lastuse = timernow();
+  b->disk = 1;
+  blink(h, b);
+  release(&bcache.bucket[h].lock);
+
+  virtio_disk_start(b, 0);
+  return 0;
+}
+
+// Print the size and hit rate of the cache.
+void
+bstat(void)
+{
+  uint hits = 0, misses = 0;
+
+  for(int i = 0; i < NBUCKET; i++){
+    hits += bcache.bucket[i].hits;
+    misses += bcache.bucket[i].misses;
+  }
+  printf("bcache: %d buffers, %d hits, %d misses", bcache.nbuf, hits, misses);
+  if(hits + misses > 0)
+    printf(", %d%% hit rate", (int)((uint64)hits * 100 / (hits + misses)));
+  printf("\n");
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -96,8 +376,12 @@ bread(uint dev, uint blockno)
 
   b = bget(dev, blockno);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
-    b->valid = 1;
+    // bprefetch() may be reading it already.
+    virtio_disk_wait(b);
+    if(!b->valid){
+      virtio_disk_rw(b, 0);
+      b->valid = 1;
+    }
   }
   return b;
 }
@@ -111,43 +395,62 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Start writing b's contents to disk, without waiting for the
+// write to finish. Must be locked, and must stay locked until
+// bwait() returns, so that nobody changes b->data meanwhile.
+// Callers start a batch of writes and then wait for each, so
+// that the disk has the whole batch queued at once.
+void
+bwrite_start(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwrite_start");
+  virtio_disk_start(b, 1);
+}
+
+// Wait for a write started by bwrite_start().
+void
+bwait(struct buf *b)
+{
+  virtio_disk_wait(b);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Stamp it with the time of last use, for bget()'s recycling.
 void
 brelse(struct buf *b)
 {
+  uint h;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  h = bhash(b->dev, b->blockno);
+  acquire(&bcache.bucket[h].lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->lastuse = timernow();
   }
-  
-  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  uint h = bhash(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[h].lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  uint h = bhash(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[h].lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
 }
-
-
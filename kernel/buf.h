@@ -1,12 +1,16 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int write;   // is the disk's transfer a write?
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint64 lastuse; // timernow() at last brelse(), for recycling
+  int bucket;   // hash bucket it is listed in, or -1
+  struct buf *prev; // hash bucket list
   struct buf *next;
-  uchar data[BSIZE];
+  struct buf *qnext; // disk queue, and bufs of one disk request
+  uchar *data;  // BSIZE bytes, in a page shared with other bufs
 };
 
@@ -0,0 +1,174 @@
+// Directory entry cache.
+//
+// Remembers what dirlookup() found: for a name in a directory,
+// the inode number it stands for and the offset of its entry,
+// or that the directory has no such name (a negative entry),
+// so that looking the same name up again reads no directory
+// blocks. An entry is keyed by the directory (dev, inum) and
+// the name.
+//
+// Entries change only with the directory's inode locked:
+// dirlookup() adds them, dirlink() and sys_unlink() update
+// them as they change the directory, and iput() drops a
+// directory's entries when it frees the directory.
+//
+// When the cache is full, the least recently used entry
+// is replaced.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+
+#define NDCHASH 61
+
+struct dcentry {
+  uint dev;
+  uint dinum;              // directory, 0 if the entry is free
+  char name[DIRSIZ];
+  uint inum;               // 0 for a negative entry
+  uint off;                // offset of the dirent in the directory
+  struct dcentry *hnext;   // hash chain
+  struct dcentry *prev;    // LRU list, least recent first
+  struct dcentry *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct dcentry ent[NDCACHE];
+  struct dcentry *hash[NDCHASH];
+  struct dcentry lru;
+} dcache;
+
+static struct dcentry**
+bucket(uint dev, uint dinum, char *name)
+{
+  uint h = dev * 31 + dinum;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return &dcache.hash[h % NDCHASH];
+}
+
+// Find the entry for name in directory dp, or 0.
+// Caller must hold dcache.lock.
+static struct dcentry*
+dcfind(struct inode *dp, char *name)
+{
+  struct dcentry *e;
+
+  for(e = *bucket(dp->dev, dp->inum, name); e; e = e->hnext)
+    if(e->dev == dp->dev && e->dinum == dp->inum && namecmp(e->name, name) == 0)
+      return e;
+  return 0;
+}
+
+// Unlink e from its hash chain, and make it the next
+// entry to be reused. Caller must hold dcache.lock.
+static void
+dcremove(struct dcentry *e)
+{
+  struct dcentry **pp;
+
+  for(pp = bucket(e->dev, e->dinum, e->name); *pp != e; pp = &(*pp)->hnext)
+    ;
+  *pp = e->hnext;
+  e->dinum = 0;
+
+  e->prev->next = e->next;
+  e->next->prev = e->prev;
+  e->next = dcache.lru.next;
+  e->prev = &dcache.lru;
+  dcache.lru.next->prev = e;
+  dcache.lru.next = e;
+}
+
+// Move e to the most recent end of the LRU list.
+static void
+dctouch(struct dcentry *e)
+{
+  e->prev->next = e->next;
+  e->next->prev = e->prev;
+  e->next = &dcache.lru;
+  e->prev = dcache.lru.prev;
+  dcache.lru.prev->next = e;
+  dcache.lru.prev = e;
+}
+
+void
+dcacheinit(void)
+{
+  struct dcentry *e;
+
+  initlock(&dcache.lock, "dcache");
+  dcache.lru.prev = dcache.lru.next = &dcache.lru;
+  for(e = dcache.ent; e < &dcache.ent[NDCACHE]; e++){
+    e->next = &dcache.lru;
+    e->prev = dcache.lru.prev;
+    dcache.lru.prev->next = e;
+    dcache.lru.prev = e;
+  }
+}
+
+// Look name up in directory dp, which the caller has locked.
+// Returns 1 if the cache knows the answer, and sets *inum to
+// the inode number (0 if dp has no such name) and *off to the
+// offset of its entry. Returns 0 if the cache does not know.
+int
+dcget(struct inode *dp, char *name, uint *inum, uint *off)
+{
+  struct dcentry *e;
+
+  acquire(&dcache.lock);
+  if((e = dcfind(dp, name)) == 0){
+    release(&dcache.lock);
+    return 0;
+  }
+  *inum = e->inum;
+  *off = e->off;
+  dctouch(e);
+  release(&dcache.lock);
+  return 1;
+}
+
+// Record that name in directory dp, which the caller has
+// locked, is inode inum at offset off, or is not there if
+// inum is 0.
+void
+dcadd(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dcentry *e;
+
+  acquire(&dcache.lock);
+  if((e = dcfind(dp, name)) == 0){
+    e = dcache.lru.next;
+    if(e->dinum)
+      dcremove(e);
+    e->dev = dp->dev;
+    e->dinum = dp->inum;
+    strncpy(e->name, name, DIRSIZ);
+    e->hnext = *bucket(dp->dev, dp->inum, name);
+    *bucket(dp->dev, dp->inum, name) = e;
+  }
+  e->inum = inum;
+  e->off = off;
+  dctouch(e);
+  release(&dcache.lock);
+}
+
+// Directory dp is being freed: forget its entries.
+void
+dcpurge(struct inode *dp)
+{
+  struct dcentry *e;
+
+  acquire(&dcache.lock);
+  for(e = dcache.ent; e < &dcache.ent[NDCACHE]; e++)
+    if(e->dinum == dp->inum && e->dev == dp->dev)
+      dcremove(e);
+  release(&dcache.lock);
+}
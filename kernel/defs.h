@@ -8,14 +8,20 @@ struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwrite_start(struct buf*);
+void            bwait(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bprefetch(uint, uint);
+int             bshrink(int);
+void            bstat(void);
 
 // console.c
 void            consoleinit(void);
@@ -66,13 +72,32 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void*           kalloc_order(int);
+void            kfree_order(void *, int);
+void            kref(void *);
+int             krefcnt(void *);
+uint64          kfreepages(void);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
+void            begin_op_n(int);
+int             log_maxop(void);
 void            end_op(void);
 
+// dcache.c
+void            dcacheinit(void);
+int             dcget(struct inode*, char*, uint*, uint*);
+void            dcadd(struct inode*, char*, uint, uint);
+void            dcpurge(struct inode*);
+
+// pcache.c
+void            pcacheinit(void);
+uint64          pcget(struct inode*, uint, uint);
+void            pcadd(struct inode*, uint, uint, uint64);
+void            pcinval(struct inode*);
+
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
@@ -103,8 +128,18 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+int             kthread(char*, void (*)(void));
 int             wait(uint64);
 void            wakeup(void*);
+void            wakeup_one(void*);
+void            sleepticks(uint);
+int             deadlinepassed(uint);
+void            schedstat(void);
+int             setpriority(int, int, int);
+int             getpriority(int, int*);
+int             setaffinity(int, int);
+int             getaffinity(int);
+int             getcpu(void);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
@@ -150,6 +185,10 @@ void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+void            timerset(int, uint64);
+uint64          timerget(int);
+uint64          timernow(void);
+uint            tickupdate(void);
 
 // uart.c
 void            uartinit(void);
@@ -167,7 +206,13 @@ pagetable_t     uvmcreate(void);
 void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
-int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopy(pagetable_t, pagetable_t, uint64, uint64);
+int             vmfault(pagetable_t, uint64, int);
+void            vmprefault(uint64, uint64);
+void            vmaprefill(pagetable_t, struct vma*);
+void            vmafree(struct vma*, int);
+int             vmaunmap(struct proc*, uint64, uint64);
+int             vmacopy(struct proc*, struct proc*);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
@@ -186,6 +231,11 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_start(struct buf *, int);
+void            virtio_disk_wait(struct buf *);
+void            virtio_disk_plug(void);
+void            virtio_disk_unplug(void);
+void            virtio_disk_stat(void);
 void            virtio_disk_intr(void);
 
 // virtio_net.c
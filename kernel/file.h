@@ -16,8 +16,11 @@ struct file {
 // in-memory copy of an inode
 struct inode {
   uint dev;           // Device number
-  uint inum;          // Inode number
+  uint inum;          // Inode number, 0 if the entry is unused
   int ref;            // Reference count
+  struct inode *hnext; // itable hash chain
+  struct inode *prev; // itable LRU list, while ref == 0
+  struct inode *next;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -26,7 +29,16 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  union {
+    uint addrs[NDIRECT+1];
+    struct {
+      struct extent ext[NEXTENT];
+      uint extblock;
+    };
+  };
+
+  uint lastbn;        // block readi() read last, for readahead
+  uint raend;         // last block read ahead
 };
 
 // map major device number to device functions.
@@ -59,34 +59,82 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// The data blocks are divided into allocation groups of
+// AGBLOCKS blocks, and each CPU starts out allocating in a
+// group of its own, so that files written at the same time on
+// different CPUs do not interleave. The caller of balloc()
+// passes the block it would like, usually the one after the
+// file's last block, and balloc() takes the first free block
+// from there on. Without a goal, it goes on from the block this
+// CPU allocated last. The bitmap is scanned a word at a time.
 
-// Allocate a zeroed disk block.
-// returns 0 if out of disk space.
+#define AGBLOCKS 256
+
+static uint bhint[NCPU];  // per-CPU: where to look next
+
+// Allocate the first free block in [from, to), zeroed.
+// returns 0 if there is none.
 static uint
-balloc(uint dev)
+bscan(uint dev, uint from, uint to)
 {
-  int b, bi, m;
   struct buf *bp;
+  uint b, base, end, bi, m;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
+  for(b = from; b < to; b = end){
+    base = b - b % BPB;
+    end = base + BPB < to ? base + BPB : to;
     bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
+    for(bi = b - base; base + bi < end; bi++){
+      if(bi % 32 == 0 && ((uint*)bp->data)[bi/32] == 0xffffffff){
+        bi += 31;  // a whole word of blocks in use
+        continue;
+      }
       m = 1 << (bi % 8);
       if((bp->data[bi/8] & m) == 0){  // Is block free?
         bp->data[bi/8] |= m;  // Mark block in use.
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+        bzero(dev, base + bi);
+        return base + bi;
       }
     }
     brelse(bp);
   }
-  printf("balloc: out of blocks\n");
   return 0;
 }
 
+// Allocate a zeroed disk block, goal if it is free, else the
+// next free one after it. goal 0 means no preference.
+// returns 0 if out of disk space.
+static uint
+balloc(uint dev, uint goal)
+{
+  uint b, datastart = sb.size - sb.nblocks;
+  int id;
+
+  push_off();
+  id = cpuid();
+  pop_off();
+
+  if(goal < datastart || goal >= sb.size){
+    goal = bhint[id];
+    if(goal < datastart || goal >= sb.size){
+      // this CPU's first allocation: pick its group.
+      uint ngroups = (sb.nblocks + AGBLOCKS - 1) / AGBLOCKS;
+      goal = datastart + (id % ngroups) * AGBLOCKS;
+    }
+  }
+
+  if((b = bscan(dev, goal, sb.size)) == 0 &&
+     (b = bscan(dev, datastart, goal)) == 0){
+    printf("balloc: out of blocks\n");
+    return 0;
+  }
+  bhint[id] = b + 1;
+  return b;
+}
+
 // Free a disk block.
 static void
 bfree(int dev, uint b)
@@ -134,7 +182,8 @@ bfree(int dev, uint b)
 //   the number of in-memory pointers to the entry (open
 //   files and current directories). iget() finds or
 //   creates a table entry and increments its ref; iput()
-//   decrements ref.
+//   decrements ref. A free entry still caches its inode,
+//   until iget() recycles it for another one.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
@@ -164,29 +213,84 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
+// The inode table is a hash table keyed by (dev, inum), with
+// the free entries also on a list in least-recently-used
+// order. It grows a page of entries at a time, until it holds
+// NINODE entries; after that, iget() recycles the least
+// recently used free entry, and only grows the table if no
+// entry is free.
+//
 // The itable.lock spin-lock protects the allocation of itable
 // entries. Since ip->ref indicates whether an entry is free,
 // and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// holds, one must hold itable.lock while using any of those fields,
+// and the hash and LRU links.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 61
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *hash[NIHASH];
+  struct inode lru;   // free entries; lru.next is the least recent
+  int n;              // entries allocated
 } itable;
 
+static struct inode**
+ihash(uint dev, uint inum)
+{
+  return &itable.hash[(dev * 31 + inum) % NIHASH];
+}
+
+static void
+lru_remove(struct inode *ip)
+{
+  ip->prev->next = ip->next;
+  ip->next->prev = ip->prev;
+}
+
+// Add a free entry to the most recent end of the LRU list.
+static void
+lru_append(struct inode *ip)
+{
+  ip->next = &itable.lru;
+  ip->prev = itable.lru.prev;
+  itable.lru.prev->next = ip;
+  itable.lru.prev = ip;
+}
+
+// Add a page of free, unused entries to the table.
+// Caller must hold itable.lock.
+// Returns 0 if out of memory.
+static int
+igrow(void)
+{
+  struct inode *ip;
+  char *page;
+
+  if((page = kalloc()) == 0)
+    return 0;
+  memset(page, 0, PGSIZE);
+  for(ip = (struct inode*)page; ip + 1 <= (struct inode*)(page + PGSIZE); ip++){
+    initsleeplock(&ip->lock, "inode");
+    // unused entries go to the front, to be used first.
+    ip->prev = &itable.lru;
+    ip->next = itable.lru.next;
+    itable.lru.next->prev = ip;
+    itable.lru.next = ip;
+    itable.n++;
+  }
+  return 1;
+}
+
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  itable.lru.prev = itable.lru.next = &itable.lru;
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -235,7 +339,7 @@ iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs)); // or extents
   log_write(bp);
   brelse(bp);
 }
@@ -246,31 +350,40 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, **pp;
 
   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+  for(ip = *ihash(dev, inum); ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref == 0)
+        lru_remove(ip);
       ip->ref++;
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+  // Recycle an inode entry, or make more.
+  if(itable.n < NINODE || itable.lru.next == &itable.lru){
+    if(!igrow() && itable.lru.next == &itable.lru)
+      panic("iget: no inodes");
+  }
+  ip = itable.lru.next;
+  lru_remove(ip);
+  if(ip->inum){
+    for(pp = ihash(ip->dev, ip->inum); *pp != ip; pp = &(*pp)->hnext)
+      ;
+    *pp = ip->hnext;
+  }
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->hnext = *ihash(dev, inum);
+  *ihash(dev, inum) = ip;
   release(&itable.lock);
 
   return ip;
@@ -308,7 +421,8 @@ ilock(struct inode *ip)
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs)); // or extents
+    ip->lastbn = ip->raend = 0;
     brelse(bp);
     ip->valid = 1;
     if(ip->type == 0)
@@ -347,6 +461,8 @@ iput(struct inode *ip)
 
     release(&itable.lock);
 
+    if(ip->type == T_DIR)
+      dcpurge(ip);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
@@ -358,6 +474,8 @@ iput(struct inode *ip)
   }
 
   ip->ref--;
+  if(ip->ref == 0)
+    lru_append(ip);
   release(&itable.lock);
 }
 
@@ -375,6 +493,92 @@ iunlockput(struct inode *ip)
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
 // listed in block ip->addrs[NDIRECT].
+//
+// On a file system with FS_EXTENTS, the blocks are instead
+// described by extents: runs of consecutive blocks, listed in
+// ip->ext[] and then in block ip->extblock. A file that grows
+// gets the block after its last run if that is free, so that
+// a file written sequentially usually needs only a few runs,
+// all in the inode, and bmap() needs no disk reads at all.
+
+// Extent version of bmap(). Since files have no holes, bn
+// can be at most one past the last block, and then a block
+// is allocated.
+static uint
+ebmap(struct inode *ip, uint bn)
+{
+  struct buf *bp = 0;
+  struct extent *e, *last = 0;
+  uint addr = 0;
+  int i, lasti = -1;
+
+  for(i = 0; i < NEXTENT + NEXTBLOCK; i++){
+    if(i < NEXTENT){
+      e = &ip->ext[i];
+    } else {
+      if(ip->extblock == 0)
+        break;
+      if(bp == 0)
+        bp = bread(ip->dev, ip->extblock);
+      e = (struct extent*)bp->data + (i - NEXTENT);
+    }
+    if(e->len == 0)
+      break;
+    if(bn < e->len){
+      addr = e->start + bn;
+      goto out;
+    }
+    bn -= e->len;
+    last = e;
+    lasti = i;
+  }
+
+  if(bn != 0)
+    goto out;  // a hole
+
+  // bn is the block after the last. grow the last run,
+  // or start a new one.
+  if(last){
+    if((addr = balloc(ip->dev, last->start + last->len)) == 0)
+      goto out;
+    if(addr == last->start + last->len){
+      last->len++;
+      if(lasti >= NEXTENT)
+        log_write(bp);
+      goto out;
+    }
+  } else if((addr = balloc(ip->dev, 0)) == 0){
+    goto out;
+  }
+  if(i == NEXTENT + NEXTBLOCK){
+    bfree(ip->dev, addr);  // out of extents
+    addr = 0;
+    goto out;
+  }
+  if(i < NEXTENT){
+    e = &ip->ext[i];
+  } else {
+    if(ip->extblock == 0){
+      if((ip->extblock = balloc(ip->dev, addr + 1)) == 0){
+        bfree(ip->dev, addr);
+        addr = 0;
+        goto out;
+      }
+    }
+    if(bp == 0)
+      bp = bread(ip->dev, ip->extblock);
+    e = (struct extent*)bp->data + (i - NEXTENT);
+  }
+  e->start = addr;
+  e->len = 1;
+  if(i >= NEXTENT)
+    log_write(bp);
+
+out:
+  if(bp)
+    brelse(bp);
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
@@ -385,9 +589,12 @@ bmap(struct inode *ip, uint bn)
   uint addr, *a;
   struct buf *bp;
 
+  if(sb.flags & FS_EXTENTS)
+    return ebmap(ip, bn);
+
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip->dev, bn > 0 && ip->addrs[bn-1] ? ip->addrs[bn-1] + 1 : 0);
       if(addr == 0)
         return 0;
       ip->addrs[bn] = addr;
@@ -399,7 +606,7 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip->dev, ip->addrs[NDIRECT-1] ? ip->addrs[NDIRECT-1] + 1 : 0);
       if(addr == 0)
         return 0;
       ip->addrs[NDIRECT] = addr;
@@ -407,7 +614,7 @@ bmap(struct inode *ip, uint bn)
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip->dev, (bn > 0 ? a[bn-1] : ip->addrs[NDIRECT]) + 1);
       if(addr){
         a[bn] = addr;
         log_write(bp);
@@ -420,6 +627,35 @@ bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
+// Free the blocks of the runs e[0..n-1], and clear them.
+static void
+efree(uint dev, struct extent *e, int n)
+{
+  for(int i = 0; i < n && e[i].len; i++){
+    for(uint b = 0; b < e[i].len; b++)
+      bfree(dev, e[i].start + b);
+    e[i].start = e[i].len = 0;
+  }
+}
+
+// Extent version of itrunc().
+static void
+etrunc(struct inode *ip)
+{
+  struct buf *bp;
+
+  efree(ip->dev, ip->ext, NEXTENT);
+  if(ip->extblock){
+    bp = bread(ip->dev, ip->extblock);
+    efree(ip->dev, (struct extent*)bp->data, NEXTBLOCK);
+    brelse(bp);
+    bfree(ip->dev, ip->extblock);
+    ip->extblock = 0;
+  }
+  ip->size = 0;
+  iupdate(ip);
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
@@ -429,6 +665,11 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  pcinval(ip);
+  if(sb.flags & FS_EXTENTS){
+    etrunc(ip);
+    return;
+  }
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -464,6 +705,38 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// readi() has just read block bn of ip. If that continues a
+// sequential scan (from the start of the file, or from the
+// block read last), keep the NREADAHEAD blocks after it on
+// their way into the buffer cache.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint bn)
+{
+  uint addr, last;
+
+  if(bn != 0 && bn != ip->lastbn && bn != ip->lastbn + 1){
+    // random access: start over from here.
+    ip->lastbn = ip->raend = bn;
+    return;
+  }
+  ip->lastbn = bn;
+  if(ip->raend < bn)
+    ip->raend = bn;
+  if(ip->size == 0)
+    return;
+  last = (ip->size - 1) / BSIZE;
+  virtio_disk_plug();
+  while(ip->raend < bn + NREADAHEAD && ip->raend < last){
+    // blocks below the size are never holes, so bmap()
+    // will not try to allocate.
+    if((addr = bmap(ip, ip->raend + 1)) == 0 || bprefetch(ip->dev, addr) < 0)
+      break;
+    ip->raend++;
+  }
+  virtio_disk_unplug();
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -484,6 +757,7 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     if(addr == 0)
       break;
     bp = bread(ip->dev, addr);
+    readahead(ip, off/BSIZE);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
@@ -510,9 +784,10 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if((sb.flags & FS_EXTENTS) == 0 && off + n > MAXFILE*BSIZE)
     return -1;
 
+  pcinval(ip);
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
@@ -532,7 +807,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 
   // write the i-node back to disk even if the size didn't change
   // because the loop above might have called bmap() and added a new
-  // block to ip->addrs[].
+  // block to ip->addrs[] or ip->ext[].
   iupdate(ip);
 
   return tot;
@@ -546,6 +821,229 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Indexed directories
+//
+// A directory starts out flat: an array of dirents, searched
+// from the start. On a file system with FS_DIRINDEX, a flat
+// directory whose only block is full is converted: its block
+// becomes the first leaf, and block 0 the index (see struct
+// dirindex in fs.h). Looking a name up then reads the index
+// and one leaf. When a name's leaf is full, the leaf is split
+// in two by hash, and the new leaf added at the end of the
+// directory. Larger flat directories from older images stay
+// flat.
+
+static uint
+dirhash(char *name)
+{
+  uint h = 2166136261;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+// Is dp an indexed directory? Caller must hold dp's lock.
+// Reads block 0 with bread() rather than readi(), which
+// would take it for the start of a sequential scan and
+// read ahead across the leaves.
+static int
+dirindexed(struct inode *dp)
+{
+  struct buf *bp;
+  struct dirindex *x;
+  int r;
+
+  if(dp->size < 2*BSIZE)
+    return 0;
+  bp = bread(dp->dev, bmap(dp, 0));
+  x = (struct dirindex*)bp->data;
+  r = x->inum == 0 && x->magic == DIRMAGIC;
+  brelse(bp);
+  return r;
+}
+
+// Return the index entry of the leaf for hash h.
+static int
+dirleaf(struct dirindex *ix, uint h)
+{
+  int lo = 1, hi = ix[0].n;
+
+  while(lo < hi){
+    int mid = (lo + hi + 1) / 2;
+    if(ix[mid].hash <= h)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// Look name up in indexed directory dp. Returns its inum
+// and sets *poff, or returns 0.
+static uint
+ixlookup(struct inode *dp, char *name, uint *poff)
+{
+  struct buf *bp;
+  struct dirent *de;
+  uint leaf, inum = 0;
+
+  bp = bread(dp->dev, bmap(dp, 0));
+  leaf = ((struct dirindex*)bp->data)[dirleaf((struct dirindex*)bp->data, dirhash(name))].leaf;
+  brelse(bp);
+
+  bp = bread(dp->dev, bmap(dp, leaf));
+  de = (struct dirent*)bp->data;
+  for(int j = 0; j < DPB; j++){
+    if(de[j].inum && namecmp(name, de[j].name) == 0){
+      inum = de[j].inum;
+      *poff = leaf*BSIZE + j*sizeof(struct dirent);
+      break;
+    }
+  }
+  brelse(bp);
+  return inum;
+}
+
+// Turn dp, a flat directory of one full block, into an
+// indexed directory with that block as its only leaf.
+// Returns 0, or -1 if out of disk space.
+static int
+ixconvert(struct inode *dp)
+{
+  struct buf *b0, *b1;
+  struct dirindex *ix;
+  uint addr0, addr1;
+
+  addr0 = bmap(dp, 0);
+  if((addr1 = bmap(dp, 1)) == 0)
+    return -1;
+  b0 = bread(dp->dev, addr0);
+  b1 = bread(dp->dev, addr1);
+  memmove(b1->data, b0->data, BSIZE);
+  memset(b0->data, 0, BSIZE);
+  ix = (struct dirindex*)b0->data;
+  ix[0].magic = DIRMAGIC;
+  ix[0].n = 1;
+  ix[1].hash = 0;
+  ix[1].leaf = 1;
+  log_write(b1);
+  log_write(b0);
+  brelse(b1);
+  brelse(b0);
+
+  dp->size = 2*BSIZE;
+  iupdate(dp);
+  dcpurge(dp);  // the entries have moved
+  return 0;
+}
+
+// Pick a hash to split a full leaf at: one of the leaf's
+// hashes, above the lowest, with about half of the entries
+// below it. Returns 0 if all the entries have the same hash.
+static uint
+ixsplithash(struct dirent *de)
+{
+  uint h[DPB], best = 0;
+  int j, k, below, bestdiff = DPB;
+
+  for(j = 0; j < DPB; j++)
+    h[j] = dirhash(de[j].name);
+  for(j = 0; j < DPB; j++){
+    below = 0;
+    for(k = 0; k < DPB; k++)
+      if(h[k] < h[j])
+        below++;
+    if(below == 0)
+      continue;
+    int diff = below > DPB/2 ? below - DPB/2 : DPB/2 - below;
+    if(diff < bestdiff){
+      best = h[j];
+      bestdiff = diff;
+    }
+  }
+  return best;
+}
+
+// Add (name, inum) to indexed directory dp, splitting the
+// leaf if it is full. Returns 0, or -1 if the directory
+// cannot grow.
+static int
+ixlink(struct inode *dp, char *name, uint inum)
+{
+  struct buf *b0, *bl, *bn = 0, *bp;
+  struct dirindex *ix;
+  struct dirent *de;
+  uint h = dirhash(name), m, leaf, newleaf, addr;
+  int i, j, k;
+
+  b0 = bread(dp->dev, bmap(dp, 0));
+  ix = (struct dirindex*)b0->data;
+  i = dirleaf(ix, h);
+  leaf = ix[i].leaf;
+  bl = bread(dp->dev, bmap(dp, leaf));
+  bp = bl;
+
+  de = (struct dirent*)bl->data;
+  for(j = 0; j < DPB; j++)
+    if(de[j].inum == 0)
+      break;
+
+  if(j == DPB){
+    // split the leaf.
+    if(ix[0].n == NDIRLEAF || (m = ixsplithash(de)) == 0)
+      goto bad;
+    newleaf = dp->size / BSIZE;
+    if((addr = bmap(dp, newleaf)) == 0)
+      goto bad;
+    bn = bread(dp->dev, addr);
+    struct dirent *nde = (struct dirent*)bn->data;
+    for(j = k = 0; j < DPB; j++){
+      if(dirhash(de[j].name) >= m){
+        nde[k++] = de[j];
+        memset(&de[j], 0, sizeof(de[j]));
+      }
+    }
+    memmove(&ix[i+2], &ix[i+1], (ix[0].n - i) * sizeof(ix[0]));
+    ix[i+1].inum = ix[i+1].magic = ix[i+1].n = 0;
+    ix[i+1].hash = m;
+    ix[i+1].leaf = newleaf;
+    ix[0].n++;
+    log_write(b0);
+    dp->size += BSIZE;
+    iupdate(dp);
+    dcpurge(dp);  // the entries have moved
+
+    if(h >= m){
+      bp = bn;
+      leaf = newleaf;
+    }
+    de = (struct dirent*)bp->data;
+    for(j = 0; j < DPB; j++)
+      if(de[j].inum == 0)
+        break;
+  }
+
+  strncpy(de[j].name, name, DIRSIZ);
+  de[j].inum = inum;
+  log_write(bl);
+  if(bn){
+    log_write(bn);
+    brelse(bn);
+  }
+  brelse(bl);
+  brelse(b0);
+  dcadd(dp, name, inum, leaf*BSIZE + j*sizeof(struct dirent));
+  return 0;
+
+bad:
+  brelse(bl);
+  brelse(b0);
+  return -1;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
@@ -557,6 +1055,25 @@ dirlookup(struct inode *dp, char *name, uint *poff)
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(dcget(dp, name, &inum, &off)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
+  if(dirindexed(dp)){
+    if((inum = ixlookup(dp, name, &off)) == 0){
+      dcadd(dp, name, 0, 0);
+      return 0;
+    }
+    if(poff)
+      *poff = off;
+    dcadd(dp, name, inum, off);
+    return iget(dp->dev, inum);
+  }
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -567,10 +1084,12 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcadd(dp, name, inum, off);
       return iget(dp->dev, inum);
     }
   }
 
+  dcadd(dp, name, 0, 0);
   return 0;
 }
 
@@ -589,6 +1108,9 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
+  if(dirindexed(dp))
+    return ixlink(dp, name, inum);
+
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
@@ -597,10 +1119,18 @@ dirlink(struct inode *dp, char *name, uint inum)
       break;
   }
 
+  if(off == BSIZE && dp->size == BSIZE && (sb.flags & FS_DIRINDEX)){
+    // the directory's one block is full: index it.
+    if(ixconvert(dp) < 0)
+      return -1;
+    return ixlink(dp, name, inum);
+  }
+
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     return -1;
+  dcadd(dp, name, inum, off);
 
   return 0;
 }
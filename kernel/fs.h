@@ -20,14 +20,33 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint flags;        // Format options, FS_*; 0 in older images
 };
 
 #define FSMAGIC 0x10203040
 
+#define FS_EXTENTS  0x1  // inodes map their blocks with extents
+#define FS_DIRINDEX 0x2  // directories that outgrow a block get indexed
+
+// Without FS_EXTENTS, an inode lists its first NDIRECT blocks,
+// and the block at addrs[NDIRECT] lists the next NINDIRECT.
 #define NDIRECT 12
 #define NINDIRECT (BSIZE / sizeof(uint))
 #define MAXFILE (NDIRECT + NINDIRECT)
 
+// With FS_EXTENTS, an inode describes its blocks as runs of
+// consecutive blocks, in file order: NEXTENT of them in the
+// inode, and NEXTBLOCK more in block extblock. A zero len
+// ends the list. Files have no holes, so a run's position
+// in the file is the total length of the runs before it.
+struct extent {
+  uint start;   // first block of the run
+  uint len;     // number of blocks
+};
+
+#define NEXTENT 6
+#define NEXTBLOCK (BSIZE / sizeof(struct extent))
+
 // On-disk inode structure
 struct dinode {
   short type;           // File type
@@ -35,7 +54,13 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  union {
+    uint addrs[NDIRECT+1];   // Data block addresses
+    struct {
+      struct extent ext[NEXTENT]; // Data block runs (FS_EXTENTS)
+      uint extblock;              // Block of further runs
+    };
+  };
 };
 
 // Inodes per block.
@@ -58,3 +83,23 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// Dirents per block.
+#define DPB           (BSIZE / sizeof(struct dirent))
+
+// An indexed directory's block 0 is an index of its other
+// blocks, the leaves, by the hash of the names they hold: a
+// name is in the leaf of the last entry whose hash is at most
+// the name's. The entries are disguised as unused dirents
+// (inum 0), so that programs that read a directory as an
+// array of dirents, like ls, only see the leaves' entries.
+struct dirindex {
+  ushort inum;    // always 0
+  ushort magic;   // DIRMAGIC in entry 0, which heads the index
+  uint n;         // entry 0: number of leaves
+  uint hash;      // lowest name hash in the leaf
+  uint leaf;      // directory block holding the leaf
+};
+
+#define DIRMAGIC 0x4958
+#define NDIRLEAF (BSIZE / sizeof(struct dirindex) - 1)
+
@@ -1,6 +1,31 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or naturally aligned blocks of 2^order pages.
+//
+// Physical memory is managed by a buddy allocator with one free
+// list per order, 0..MAXORDER. A block of order k is 2^k pages
+// long and aligned to its own size, so its buddy is found by
+// flipping bit k of its page index, and freed blocks coalesce
+// with a free buddy into a block of the next order up.
+//
+// Single pages go through a fast path: each CPU keeps a private
+// free list, so kalloc() and kfree() normally touch only
+// CPU-local state. A CPU whose list runs dry refills a batch of
+// pages from the buddy allocator, and if that is empty too,
+// steals half of a sibling CPU's list. A CPU whose list grows
+// too long hands a batch back to the buddy allocator.
+//
+// Single pages carry a reference count so that they can be
+// shared copy-on-write between page tables. kalloc() returns a
+// page with one reference, kref() adds one, and kfree() only
+// releases the page when the last reference is dropped. Blocks
+// from kalloc_order() have no reference count: they must go
+// back through kfree_order(), and kfree() on any of their pages
+// panics.
+//
+// When memory runs out, kalloc() has the buffer cache
+// give pages back (see bshrink() in bio.c).
 
 #include "types.h"
 #include "param.h"
@@ -9,57 +34,290 @@
 #include "riscv.h"
 #include "defs.h"
 
+#define KBATCH   32          // pages moved between a CPU and the buddy lists at once
+#define KHIGH    (4*KBATCH)  // drain above this many free pages on one CPU
+
+#define NPAGES   ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PAGEIDX(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define BLOCKFREE 0x80       // pgstate[] flag: first page of a free block
+#define BLOCKUSED 0x40       // pgstate[] flag: page of a kalloc_order() block
+
 void freerange(void *pa_start, void *pa_end);
+static void kalloctest(void);
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
 struct run {
   struct run *next;
+  struct run *prev;  // only used on the buddy free lists
 };
 
+// per-CPU free lists of single pages. the lock is almost
+// always uncontended; it is only there so that another
+// CPU can steal pages.
 struct {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;
+} kmem[NCPU];
+
+// buddy allocator. free[k] is a circular list of free
+// blocks of order k. pgstate[i] is BLOCKFREE|k if page i
+// starts a free block of order k, BLOCKUSED|k if it is
+// in a block of order k > 0 that kalloc_order() handed
+// out, and 0 otherwise.
+struct {
+  struct spinlock lock;
+  struct run free[MAXORDER+1];
+  uchar pgstate[NPAGES];
+  uint64 nfree;   // pages in all free blocks
+} buddy;
+
+// reference counts of single pages, indexed by PAGEIDX.
+// updated with atomic instructions rather than a lock.
+int refcnt[NPAGES];
+
+static void
+list_push(struct run *head, struct run *r)
+{
+  r->next = head->next;
+  r->prev = head;
+  head->next->prev = r;
+  head->next = r;
+}
+
+static void
+list_remove(struct run *r)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+}
+
+// Take a free block of the given order, splitting a larger
+// block if necessary. Caller must hold buddy.lock.
+static struct run*
+buddy_alloc(int order)
+{
+  struct run *r;
+  int k;
+
+  for(k = order; k <= MAXORDER; k++)
+    if(buddy.free[k].next != &buddy.free[k])
+      break;
+  if(k > MAXORDER)
+    return 0;
+
+  r = buddy.free[k].next;
+  list_remove(r);
+  buddy.pgstate[PAGEIDX(r)] = 0;
+  buddy.nfree -= 1L << order;
+
+  // return the upper halves to the lower orders.
+  while(k > order){
+    k--;
+    struct run *half = (struct run*)((char*)r + (PGSIZE << k));
+    buddy.pgstate[PAGEIDX(half)] = BLOCKFREE | k;
+    list_push(&buddy.free[k], half);
+  }
+  return r;
+}
+
+// Return a block to the free lists, merging it with its
+// buddy for as long as the buddy is free as well.
+// Caller must hold buddy.lock.
+static void
+buddy_free(void *pa, int order)
+{
+  uint64 idx = PAGEIDX(pa);
+
+  buddy.nfree += 1L << order;
+  while(order < MAXORDER){
+    uint64 bidx = idx ^ (1L << order);
+    if(bidx >= NPAGES || buddy.pgstate[bidx] != (BLOCKFREE | order))
+      break;
+    list_remove((struct run*)(KERNBASE + bidx*PGSIZE));
+    buddy.pgstate[bidx] = 0;
+    idx &= ~(1L << order);
+    order++;
+  }
+  buddy.pgstate[idx] = BLOCKFREE | order;
+  list_push(&buddy.free[order], (struct run*)(KERNBASE + idx*PGSIZE));
+}
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&buddy.lock, "buddy");
+  for(int k = 0; k <= MAXORDER; k++)
+    buddy.free[k].next = buddy.free[k].prev = &buddy.free[k];
   freerange(end, (void*)PHYSTOP);
+  kalloctest();
 }
 
+// Hand [pa_start, pa_end) to the buddy allocator as
+// the largest aligned blocks that fit.
 void
 freerange(void *pa_start, void *pa_end)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  uint64 p = PGROUNDUP((uint64)pa_start);
+  int k;
+
+  acquire(&buddy.lock);
+  while(p + PGSIZE <= (uint64)pa_end){
+    for(k = MAXORDER; k > 0; k--){
+      uint64 sz = (uint64)PGSIZE << k;
+      if((p - KERNBASE) % sz == 0 && p + sz <= (uint64)pa_end)
+        break;
+    }
+    buddy_free((void*)p, k);
+    p += (uint64)PGSIZE << k;
+  }
+  release(&buddy.lock);
+}
+
+// Push a list of pages onto CPU id's free list.
+static void
+pushlocal(int id, struct run *list, int n)
+{
+  struct run *last;
+
+  if(list == 0)
+    return;
+  for(last = list; last->next; last = last->next)
+    ;
+  acquire(&kmem[id].lock);
+  last->next = kmem[id].freelist;
+  kmem[id].freelist = list;
+  kmem[id].nfree += n;
+  release(&kmem[id].lock);
+}
+
+// Detach the first n pages of the list *head (which must have at
+// least n entries) and return them as a list of their own.
+static struct run*
+detach(struct run **head, int n)
+{
+  struct run *first, *last;
+
+  first = last = *head;
+  for(int i = 1; i < n; i++)
+    last = last->next;
+  *head = last->next;
+  last->next = 0;
+  return first;
+}
+
+// Give a list of single pages back to the buddy allocator.
+static void
+freelist(struct run *list)
+{
+  struct run *r;
+
+  acquire(&buddy.lock);
+  while(list){
+    r = list;
+    list = r->next;
+    buddy_free(r, 0);
+  }
+  release(&buddy.lock);
+}
+
+// CPU id's free list is empty. Take a batch of pages from the
+// buddy allocator, or failing that, half of some other CPU's
+// list. Keep one page for the caller and put the rest on CPU
+// id's list. Must be called with interrupts off.
+static struct run*
+refill(int id)
+{
+  struct run *list = 0, *r;
+  int n = 0;
+
+  acquire(&buddy.lock);
+  while(n < KBATCH && (r = buddy_alloc(0)) != 0){
+    r->next = list;
+    list = r;
+    n++;
+  }
+  release(&buddy.lock);
+
+  for(int i = 1; list == 0 && i < NCPU; i++){
+    int victim = (id + i) % NCPU;
+    acquire(&kmem[victim].lock);
+    if(kmem[victim].nfree > 0){
+      n = (kmem[victim].nfree + 1) / 2;
+      list = detach(&kmem[victim].freelist, n);
+      kmem[victim].nfree -= n;
+    }
+    release(&kmem[victim].lock);
+  }
+
+  if(list == 0)
+    return 0;
+  pushlocal(id, list->next, n - 1);
+  return list;
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Return every page cached on the per-CPU lists to the buddy
+// allocator, so that they can coalesce into larger blocks.
+static void
+drainall(void)
+{
+  struct run *list;
+
+  for(int i = 0; i < NCPU; i++){
+    acquire(&kmem[i].lock);
+    list = kmem[i].freelist;
+    kmem[i].freelist = 0;
+    kmem[i].nfree = 0;
+    release(&kmem[i].lock);
+    freelist(list);
+  }
+}
+
+// Drop a reference to the page of physical memory pointed
+// at by pa, which should have been returned by a call to
+// kalloc(), and free the page if that was the last one.
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *batch = 0;
+  int id;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
+  if(buddy.pgstate[PAGEIDX(pa)] & BLOCKUSED)
+    panic("kfree: kalloc_order block");
+
+  // Only the last reference frees the page.
+  int n = __sync_sub_and_fetch(&refcnt[PAGEIDX(pa)], 1);
+  if(n > 0)
+    return;
+  if(n < 0)
+    panic("kfree: refcnt");
 
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  acquire(&kmem[id].lock);
+  r->next = kmem[id].freelist;
+  kmem[id].freelist = r;
+  kmem[id].nfree++;
+  if(kmem[id].nfree > KHIGH){
+    batch = detach(&kmem[id].freelist, KBATCH);
+    kmem[id].nfree -= KBATCH;
+  }
+  release(&kmem[id].lock);
+  pop_off();
+
+  if(batch)
+    freelist(batch);
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +327,157 @@ void *
 kalloc(void)
 {
   struct run *r;
+  int id;
+
+  push_off();
+  id = cpuid();
+  acquire(&kmem[id].lock);
+  r = kmem[id].freelist;
+  if(r){
+    kmem[id].freelist = r->next;
+    kmem[id].nfree--;
+  }
+  release(&kmem[id].lock);
+  if(r == 0)
+    r = refill(id);
+  pop_off();
+
+  if(r == 0){
+    // out of memory. the buffer cache can give some back.
+    if(bshrink(KBATCH) > 0)
+      return kalloc();
+    return 0;
+  }
+
+  memset((char*)r, 5, PGSIZE); // fill with junk
+  refcnt[PAGEIDX(r)] = 1;
+  return (void*)r;
+}
+
+// Add a reference to a page returned by kalloc().
+void
+kref(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kref");
+  if(buddy.pgstate[PAGEIDX(pa)] & BLOCKUSED)
+    panic("kref: kalloc_order block");
+  if(__sync_fetch_and_add(&refcnt[PAGEIDX(pa)], 1) < 1)
+    panic("kref: free page");
+}
+
+// Return the number of references to a page returned by kalloc().
+int
+krefcnt(void *pa)
+{
+  return __atomic_load_n(&refcnt[PAGEIDX(pa)], __ATOMIC_SEQ_CST);
+}
+
+// Return the number of free pages. The count is not exact
+// while other CPUs allocate and free.
+uint64
+kfreepages(void)
+{
+  uint64 n = buddy.nfree;
+
+  for(int i = 0; i < NCPU; i++)
+    n += kmem[i].nfree;
+  return n;
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their combined size. Order 0 is the same as kalloc().
+// Other orders are not reference counted; free them with
+// kfree_order(), never kfree() or kref().
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_order(int order)
+{
+  struct run *r;
+
+  if(order < 0 || order > MAXORDER)
+    panic("kalloc_order");
+  if(order == 0)
+    return kalloc();
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  acquire(&buddy.lock);
+  r = buddy_alloc(order);
+  release(&buddy.lock);
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+  if(r == 0){
+    // pages parked on the per-CPU lists may be all
+    // that stands between a buddy pair and a merge.
+    drainall();
+    acquire(&buddy.lock);
+    r = buddy_alloc(order);
+    release(&buddy.lock);
+  }
+  if(r == 0)
+    return 0;
+
+  // tag every page, so that kfree() and kref() can tell
+  // that it has no reference count.
+  for(uint64 i = 0; i < (1L << order); i++)
+    buddy.pgstate[PAGEIDX(r) + i] = BLOCKUSED | order;
+  memset((char*)r, 5, PGSIZE << order); // fill with junk
   return (void*)r;
 }
+
+// Free a block returned by kalloc_order(order).
+void
+kfree_order(void *pa, int order)
+{
+  if(order < 0 || order > MAXORDER)
+    panic("kfree_order");
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(((uint64)pa % (PGSIZE << order)) != 0 || (char*)pa < end ||
+     (uint64)pa + (PGSIZE << order) > PHYSTOP)
+    panic("kfree_order");
+  if(buddy.pgstate[PAGEIDX(pa)] != (BLOCKUSED | order))
+    panic("kfree_order: not a block of this order");
+
+  memset(pa, 1, PGSIZE << order);
+  for(uint64 i = 0; i < (1L << order); i++)
+    buddy.pgstate[PAGEIDX(pa) + i] = 0;
+
+  acquire(&buddy.lock);
+  buddy_free(pa, order);
+  release(&buddy.lock);
+}
+
+// Check the buddy allocator at boot: split blocks of every
+// order, and make sure that freeing them, and the single
+// pages that kalloc() parks on a per-CPU list, gives back
+// exactly the memory there was.
+static void
+kalloctest(void)
+{
+  uint64 n0 = kfreepages();
+  void *a, *b;
+
+  for(int k = 1; k <= MAXORDER; k++){
+    a = kalloc_order(k);
+    b = kalloc_order(k);
+    if(a == 0 || b == 0)
+      panic("kalloctest: kalloc_order");
+    if(((uint64)a - KERNBASE) % (PGSIZE << k) != 0 ||
+       ((uint64)b - KERNBASE) % (PGSIZE << k) != 0)
+      panic("kalloctest: alignment");
+    if(kfreepages() != n0 - (2L << k))
+      panic("kalloctest: count");
+    kfree_order(a, k);
+    kfree_order(b, k);
+  }
+
+  // kalloc() moves a batch of pages to this CPU's list.
+  // drainall(), which kalloc_order() falls back on, must
+  // hand all of them back to the buddy lists.
+  a = kalloc();
+  kfree(a);
+  drainall();
+  if(buddy.nfree != n0 || kfreepages() != n0)
+    panic("kalloctest: leak");
+}
@@ -6,29 +6,54 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "proc.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
-// write an uncommitted system call's updates to disk.
+// calls. A transaction only closes when there are no FS system
+// calls active in it. Thus there is never any reasoning required
+// about whether a commit might write an uncommitted system
+// call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// its start and end. begin_op() reserves room in the log for
+// MAXOPBLOCKS blocks; begin_op_n() reserves as many as the
+// caller asks for, up to log_maxop(). Usually it just adds the
+// reservation to the in-progress FS system calls' and returns.
+// But if the log would run out, it sleeps until the open
+// transaction has been closed.
+//
+// The log is double-buffered. The last end_op() of the open
+// transaction closes it: it copies the transaction's blocks
+// out of the buffer cache, and hands the copies to the commit
+// thread, logd. A new transaction opens at once, and FS system
+// calls go on while logd writes the old one to the log and
+// commits it. A transaction that is ready to close while logd
+// is still busy waits, and keeps accepting operations, so that
+// one commit carries the updates of many system calls.
+// end_op() does not wait for the commit.
+//
+// Committed blocks are not written to their home locations
+// right away. They stay in the log, and pinned in the buffer
+// cache, until the checkpoint thread, ckptd, installs all of
+// them at once: every CKPTTICKS ticks, or sooner if the next
+// transaction does not fit in what is left of the log. Blocks
+// written by several transactions are installed only once.
 //
-// The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
 //   header block, containing block #s for block A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// Each commit appends its blocks and rewrites the header to
+// cover them; a checkpoint empties the log. A block may appear
+// more than once, and the last copy is the one that counts.
+// The log is read and written, and blocks are installed, with
+// bufs of the log's own, never through the buffer cache.
+
+#define CKPTTICKS 50
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -42,14 +67,36 @@ struct log {
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // blocks they have reserved in total.
+  int passed;      // a waiter too big to go has woken the rest.
+  int closing;     // copying out the open transaction, please wait.
+  int committing;  // logd is busy with the closed transaction.
+  int checkpointing; // ckptd is installing the log.
+  int ckptwanted;  // the log is full; ckptd, please hurry.
   int dev;
+
+  // the open transaction.
   struct logheader lh;
+  struct buf *pin[LOGSIZE];    // cache bufs it has pinned
+
+  // the contents of the on-disk log: clh.n blocks, of which
+  // the first ncommitted are committed, and the rest are
+  // the transaction logd is committing. io[i].data holds a
+  // copy of block i as it was when its transaction closed.
+  struct logheader clh;
+  int ncommitted;
+  struct buf *cpin[LOGSIZE];
+  struct buf io[LOGSIZE];      // the log's bufs for clh's blocks
+  struct buf head;             // the log's buf for the header block
+  uchar headdata[BSIZE];
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void commit(void);
+static void checkpoint(void);
+static void logd(void);
+static void ckptd(void);
 
 void
 initlog(int dev, struct superblock *sb)
@@ -61,150 +108,320 @@ initlog(int dev, struct superblock *sb)
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
+  if (log.size - 1 > LOGSIZE || log.size - 1 < MAXOPBLOCKS)
+    panic("initlog: bad log size");
+  // the copies of the logged blocks, BSIZE each.
+  uchar *data = 0;
+  for (int i = 0; i < log.size - 1; i++) {
+    if (i % (PGSIZE/BSIZE) == 0 && (data = kalloc()) == 0)
+      panic("initlog: kalloc");
+    log.io[i].dev = dev;
+    log.io[i].data = data + (i % (PGSIZE/BSIZE)) * BSIZE;
+  }
+  log.head.dev = dev;
+  log.head.blockno = log.start;
+  log.head.data = log.headdata;
   recover_from_log();
+  if (kthread("logd", logd) < 0 || kthread("ckptd", ckptd) < 0)
+    panic("initlog: kthread");
 }
 
-// Copy committed blocks from log to their home location
+// Read (write == 0) or write blocks from..to-1 of the log
+// between the disk and their copies. All of the transfers are
+// queued at once; wait for them all.
 static void
-install_trans(int recovering)
+transfer(int from, int to, int write)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  virtio_disk_plug();
+  for (tail = from; tail < to; tail++) {
+    struct buf *b = &log.io[tail];
+    b->blockno = log.start+tail+1;
+    virtio_disk_start(b, write);
+  }
+  virtio_disk_unplug();
+  for (tail = from; tail < to; tail++)
+    virtio_disk_wait(&log.io[tail]);
+}
+
+// Write the first n blocks of the log to their home
+// locations, skipping blocks that the log has a later
+// copy of.
+static void
+install_trans(int n)
+{
+  int tail, later;
+
+  virtio_disk_plug();
+  for (tail = 0; tail < n; tail++) {
+    struct buf *b = &log.io[tail];
+    b->blockno = log.clh.block[tail];
+    for (later = tail+1; later < n; later++)
+      if (log.clh.block[later] == b->blockno)
+        break;
+    if (later == n)
+      virtio_disk_start(b, 1);
   }
+  virtio_disk_unplug();
+  for (tail = 0; tail < n; tail++)
+    virtio_disk_wait(&log.io[tail]);
 }
 
-// Read the log header from disk into the in-memory log header
+// Read the log header from disk into log.clh.
 static void
 read_head(void)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
+  struct logheader *lh = (struct logheader *) (log.head.data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+
+  virtio_disk_rw(&log.head, 0);
+  log.clh.n = lh->n;
+  for (i = 0; i < log.clh.n; i++) {
+    log.clh.block[i] = lh->block[i];
   }
-  brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write log.clh to the disk's header block.
+// This is the true point at which a
+// transaction commits.
 static void
 write_head(void)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
+  struct logheader *hb = (struct logheader *) (log.head.data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+
+  hb->n = log.clh.n;
+  for (i = 0; i < log.clh.n; i++) {
+    hb->block[i] = log.clh.block[i];
   }
-  bwrite(buf);
-  brelse(buf);
+  virtio_disk_rw(&log.head, 1);
 }
 
+// Runs at boot, before anything else looks at the file
+// system, so the buffer cache holds no copies of the blocks
+// that are installed behind its back.
 static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
+  transfer(0, log.clh.n, 0); // if committed, read the blocks from the log
+  install_trans(log.clh.n);  // and install them
+  log.clh.n = 0;
   write_head(); // clear the log
 }
 
-// called at the start of each FS system call.
+// The most blocks one FS op may reserve: half the log,
+// so that a big op does not shut all others out.
+int
+log_maxop(void)
+{
+  int n = (log.size - 1) / 2;
+
+  return n < MAXOPBLOCKS ? MAXOPBLOCKS : n;
+}
+
+// called at the start of each FS system call
+// that writes at most n blocks.
 void
-begin_op(void)
+begin_op_n(int n)
 {
+  if(n > log_maxop())
+    panic("begin_op_n");
+
   acquire(&log.lock);
   while(1){
-    if(log.committing){
-      sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    if(log.closing){
       sleep(&log, &log.lock);
+    } else if(log.lh.n + log.reserved + n > log.size - 1){
+      // this op might exhaust log space; wait for the
+      // open transaction to close, or for end_op() to
+      // give back a reservation. if there is room for a
+      // smaller op, wake the other waiters rather than swallow
+      // end_op()'s wakeup -- but only once per end_op(), or two
+      // big waiters would keep waking each other.
+      if(log.lh.n + log.reserved + MAXOPBLOCKS <= log.size - 1 && !log.passed){
+        log.passed = 1;
+        wakeup(&log.reserved);
+      }
+      sleep(&log.reserved, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
+      myproc()->logres = n;
+      // end_op() wakes one waiter at a time; pass on
+      // whatever room is left.
+      if(log.lh.n + log.reserved + MAXOPBLOCKS <= log.size - 1)
+        wakeup_one(&log.reserved);
       release(&log.lock);
       break;
     }
   }
 }
 
+// called at the start of each FS system call.
+void
+begin_op(void)
+{
+  begin_op_n(MAXOPBLOCKS);
+}
+
+// Close the open transaction, append it to the log,
+// and hand it to logd. log.closing must be set,
+// and log.lock not held.
+static void
+close_trans(void)
+{
+  int tail, n = log.clh.n;
+
+  // log.closing keeps begin_op() out, so nobody
+  // changes the blocks while they are copied.
+  for (tail = 0; tail < log.lh.n; tail++) {
+    struct buf *b = bread(log.dev, log.lh.block[tail]);
+    memmove(log.io[n+tail].data, b->data, BSIZE);
+    brelse(b);
+    log.clh.block[n+tail] = log.lh.block[tail];
+    log.cpin[n+tail] = log.pin[tail];
+  }
+
+  acquire(&log.lock);
+  log.clh.n += log.lh.n;
+  log.lh.n = 0;
+  log.closing = 0;
+  log.committing = 1;
+  wakeup(&log.clh);
+  wakeup(&log);
+  log.passed = 0;
+  wakeup(&log.reserved);
+  release(&log.lock);
+}
+
+// Close the open transaction if it is complete and the log
+// is free to take it. Caller must hold log.lock, which is
+// released while the transaction is copied.
+static void
+try_close(void)
+{
+  if(log.outstanding > 0 || log.lh.n == 0 || log.closing ||
+     log.committing || log.checkpointing)
+    return;
+  if(log.clh.n + log.lh.n > log.size - 1){
+    // no room in the log until ckptd has emptied it.
+    acquire(&tickslock);
+    log.ckptwanted = 1;
+    wakeup(&ticks);
+    release(&tickslock);
+    return;
+  }
+  log.closing = 1;
+  release(&log.lock);
+  close_trans();
+  acquire(&log.lock);
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// closes the transaction if this was the last
+// outstanding operation.
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
-  }
+  log.reserved -= myproc()->logres;
+  if(log.closing)
+    panic("log.closing");
+  // begin_op() may be waiting for log space,
+  // and this op's reservation has been given back.
+  log.passed = 0;
+  wakeup_one(&log.reserved);
+  try_close();
   release(&log.lock);
+}
+
+// The commit thread: commits each transaction that closes,
+// then closes the open one if it became ready meanwhile.
+static void
+logd(void)
+{
+  acquire(&log.lock);
+  for(;;){
+    while(!log.committing)
+      sleep(&log.clh, &log.lock);
+    release(&log.lock);
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
     commit();
+
     acquire(&log.lock);
     log.committing = 0;
     wakeup(&log);
-    release(&log.lock);
+    try_close();
   }
 }
 
-// Copy modified blocks from cache to log.
+// The checkpoint thread: empties the log every CKPTTICKS
+// ticks, or when it fills up.
 static void
-write_log(void)
+ckptd(void)
 {
-  int tail;
+  uint ticks0;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for(;;){
+    acquire(&tickslock);
+    ticks0 = tickupdate();
+    while(tickupdate() - ticks0 < CKPTTICKS && !log.ckptwanted)
+      sleepticks(ticks0 + CKPTTICKS);
+    release(&tickslock);
+
+    checkpoint();
   }
 }
 
 static void
-commit()
+commit(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
+  if (log.clh.n > log.ncommitted) {
+    transfer(log.ncommitted, log.clh.n, 1); // Write the copied blocks to the log
     write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    log.ncommitted = log.clh.n;
   }
 }
 
+// Install every committed block, and empty the log.
+static void
+checkpoint(void)
+{
+  int tail, n;
+
+  acquire(&log.lock);
+  while(log.closing || log.committing)
+    sleep(&log, &log.lock);
+  log.ckptwanted = 0;
+  n = log.ncommitted;
+  if(n == 0){
+    release(&log.lock);
+    return;
+  }
+  // keep new transactions out of the log meanwhile.
+  log.checkpointing = 1;
+  release(&log.lock);
+
+  install_trans(n);  // Write the blocks to their home locations
+  log.clh.n = 0;
+  write_head();      // Erase the transactions from the log
+  for (tail = 0; tail < n; tail++)
+    bunpin(log.cpin[tail]);
+
+  acquire(&log.lock);
+  log.ncommitted = 0;
+  log.checkpointing = 0;
+  wakeup(&log);
+  try_close();
+  release(&log.lock);
+}
+
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// The transaction's commit will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -229,8 +446,8 @@ log_write(struct buf *b)
   log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
+    log.pin[i] = b;
     log.lh.n++;
   }
   release(&log.lock);
 }
-
@@ -27,6 +27,8 @@ main()
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    pcacheinit();    // shared program text pages
+    dcacheinit();    // directory entry cache
     virtio_disk_init(); // emulated hard disk
     netinit();
     virtio_net_init();
@@ -18,6 +18,8 @@ static struct net {
 } net;
 
 int netwrite(int user_src, uint64 src, int n) {
+    if (user_src)
+        vmprefault(src, MIN(n, PGSIZE));
     acquire(&net.lock);
 
     int retval;
@@ -35,6 +37,8 @@ end:
 }
 
 int netread(int user_dst, uint64 dst, int n) {
+    if (user_dst)
+        vmprefault(dst, MIN(n, PGSIZE));
     acquire(&net.lock);
 
     int retval;
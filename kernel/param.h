@@ -1,13 +1,21 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
+#define NVMA         16  // demand-paged memory regions per process
+#define NPCACHE     256  // cached pages of read-only program text
+#define NDCACHE     256  // cached directory entries
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // cached i-nodes before unused ones are recycled
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define MAXOPBLOCKS  10  // blocks begin_op() reserves for an FS op
+#define LOGSIZE      254 // max data blocks in on-disk log
+#define NLOG         128 // default on-disk log size, with header (mkfs -l)
+#define NBUF         (MAXOPBLOCKS*3)  // minimum size of disk block cache
+#define NBUFMAX      2048  // maximum size of disk block cache
+#define NREADAHEAD   8   // blocks read ahead of a sequential reader
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define MAXORDER     9     // largest kalloc_order() block is 2^MAXORDER pages
+#define TICKCYCLES   1000000  // timer cycles per tick and per quantum; about 1/10th second in qemu
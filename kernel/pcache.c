@@ -0,0 +1,150 @@
+// Page cache for read-only program text.
+//
+// Processes running the same binary can share the physical
+// pages of its read-only segments. vmfault() looks a page up
+// here before reading it from the file, and adds the pages it
+// reads. An entry is keyed by the file (dev, inum), the file
+// offset of the page, and the number of bytes read from the
+// file into it (the rest of the page is zero).
+//
+// The cache holds one reference to each page it caches, and
+// hands out further references with kref(). Writing to or
+// truncating a file drops its entries; processes that already
+// map the old pages keep them.
+//
+// When the table is full, a clock hand looks for an entry
+// whose page no process maps any more and replaces it.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+
+#define NPCHASH 61
+
+struct pcentry {
+  uint dev;
+  uint inum;
+  uint off;              // file offset of the page
+  uint n;                // bytes of the page read from the file
+  uint64 pa;             // 0 if the entry is free
+  struct pcentry *next;  // hash chain
+};
+
+struct {
+  struct spinlock lock;
+  struct pcentry ent[NPCACHE];
+  struct pcentry *hash[NPCHASH];
+  int hand;
+} pcache;
+
+static struct pcentry**
+bucket(uint dev, uint inum)
+{
+  return &pcache.hash[(dev * 31 + inum) % NPCHASH];
+}
+
+// Unlink e from its hash chain, drop the cache's reference
+// to its page, and mark it free. Caller must hold pcache.lock.
+static void
+pcremove(struct pcentry *e)
+{
+  struct pcentry **pp;
+
+  for(pp = bucket(e->dev, e->inum); *pp != e; pp = &(*pp)->next)
+    ;
+  *pp = e->next;
+  kfree((void*)e->pa);
+  e->pa = 0;
+}
+
+void
+pcacheinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+}
+
+// Return the cached page holding n bytes of ip at file offset
+// off, with a reference added for the caller, or 0.
+uint64
+pcget(struct inode *ip, uint off, uint n)
+{
+  struct pcentry *e;
+  uint64 pa = 0;
+
+  acquire(&pcache.lock);
+  for(e = *bucket(ip->dev, ip->inum); e; e = e->next){
+    if(e->dev == ip->dev && e->inum == ip->inum && e->off == off && e->n == n){
+      pa = e->pa;
+      kref((void*)pa);
+      break;
+    }
+  }
+  release(&pcache.lock);
+  return pa;
+}
+
+// Cache page pa, which holds n bytes of ip at file offset off.
+// The caller keeps its own reference. The caller must hold
+// ip's lock, so that a write cannot slip in between reading
+// the page and caching it.
+void
+pcadd(struct inode *ip, uint off, uint n, uint64 pa)
+{
+  struct pcentry *e;
+  int i;
+
+  acquire(&pcache.lock);
+  for(e = *bucket(ip->dev, ip->inum); e; e = e->next){
+    if(e->dev == ip->dev && e->inum == ip->inum && e->off == off && e->n == n){
+      // someone else read it in at the same time.
+      release(&pcache.lock);
+      return;
+    }
+  }
+
+  for(i = 0; i < NPCACHE; i++){
+    e = &pcache.ent[pcache.hand];
+    pcache.hand = (pcache.hand + 1) % NPCACHE;
+    if(e->pa == 0)
+      break;
+    if(krefcnt((void*)e->pa) == 1){
+      pcremove(e);
+      break;
+    }
+  }
+  if(i == NPCACHE){
+    // every cached page is in use.
+    release(&pcache.lock);
+    return;
+  }
+
+  e->dev = ip->dev;
+  e->inum = ip->inum;
+  e->off = off;
+  e->n = n;
+  e->pa = pa;
+  kref((void*)pa);
+  e->next = *bucket(ip->dev, ip->inum);
+  *bucket(ip->dev, ip->inum) = e;
+  release(&pcache.lock);
+}
+
+// ip's contents are changing: forget its cached pages.
+void
+pcinval(struct inode *ip)
+{
+  struct pcentry *e, *next;
+
+  acquire(&pcache.lock);
+  for(e = *bucket(ip->dev, ip->inum); e; e = next){
+    next = e->next;
+    if(e->dev == ip->dev && e->inum == ip->inum)
+      pcremove(e);
+  }
+  release(&pcache.lock);
+}
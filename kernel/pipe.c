@@ -79,14 +79,17 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
   int i = 0;
   struct proc *pr = myproc();
 
+  vmprefault(addr, n);
   acquire(&pi->lock);
   while(i < n){
     if(pi->readopen == 0 || killed(pr)){
+      if(pi->nwrite < pi->nread + PIPESIZE)
+        wakeup_one(&pi->nwrite);  // pass on the room we were woken for
       release(&pi->lock);
       return -1;
     }
     if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
-      wakeup(&pi->nread);
+      wakeup_one(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
     } else {
       char ch;
@@ -96,7 +99,11 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
       i++;
     }
   }
-  wakeup(&pi->nread);
+  // readers and writers are woken one at a time. pass
+  // on any room that is left to the next writer.
+  wakeup_one(&pi->nread);
+  if(pi->nwrite < pi->nread + PIPESIZE)
+    wakeup_one(&pi->nwrite);
   release(&pi->lock);
 
   return i;
@@ -109,12 +116,17 @@ piperead(struct pipe *pi, uint64 addr, int n)
   struct proc *pr = myproc();
   char ch;
 
+  vmprefault(addr, n);
   acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
+  while(1){
     if(killed(pr)){
+      if(pi->nread != pi->nwrite)
+        wakeup_one(&pi->nread);  // pass on the data we were woken for
       release(&pi->lock);
       return -1;
     }
+    if(pi->nread != pi->nwrite || pi->writeopen == 0)  //DOC: pipe-empty
+      break;
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
   for(i = 0; i < n; i++){  //DOC: piperead-copy
@@ -124,7 +136,9 @@ piperead(struct pipe *pi, uint64 addr, int n)
     if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
       break;
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  wakeup_one(&pi->nwrite);  //DOC: piperead-wakeup
+  if(pi->nread != pi->nwrite)
+    wakeup_one(&pi->nread);  // leftovers for the next reader
   release(&pi->lock);
   return i;
 }
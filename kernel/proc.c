@@ -4,18 +4,87 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "sched.h"
 #include "defs.h"
 
 struct cpu cpus[NCPU];
 
 struct proc proc[NPROC];
 
+// per-CPU queues of RUNNABLE processes. a process joins the
+// queue of the CPU it last ran on. a CPU whose queue is empty
+// steals a process from another CPU's queue, and if there is
+// nothing to steal, waits for an interrupt.
+//
+// a CPU runs its SCHED_FIFO processes first, highest priority
+// first and in FIFO order among equals, each until it gives
+// up the CPU. the SCHED_FAIR processes share what is left:
+// the CPU runs the one with the least virtual runtime, which
+// grows with the time the process runs, more slowly the
+// higher its weight (see nicewt[]). a process that wakes up
+// gets a virtual runtime no more than one quantum behind the
+// least on the queue, so that sleeping doesn't earn a process
+// the CPU for long, but it does get it soon after waking up.
+//
+// there is no periodic clock interrupt. a CPU's timer is
+// armed only to preempt the process it runs when another
+// is waiting for the CPU, and for the earliest deadline of
+// the processes that went to sleep in sleepticks() on it.
+// lock order: p->lock before runq[].lock.
+struct runq {
+  struct spinlock lock;
+  struct proc *rt;            // SCHED_FIFO, by priority, linked by rqnext
+  struct proc *fair[NPROC];   // SCHED_FAIR, a min-heap by vruntime
+  int nfair;
+  uint64 minvruntime;         // the queue's virtual time; never decreases
+  int n;                      // processes on the queue
+} runq[NCPU];
+
+// how soon a woken process preempts a SCHED_FAIR one.
+#define WAKEGRAN (TICKCYCLES/10)
+
+// how long after a process leaves a CPU its memory is
+// assumed to be in that CPU's cache.
+#define CACHEHOT (TICKCYCLES/20)
+
+#define ALLCPUS ((1 << NCPU) - 1)
+
+int cpuonline;   // CPUs that have entered scheduler(), a bit per CPU
+
+// weights of the nice levels NICE_MIN..NICE_MAX. each level is
+// worth about 10% of the CPU against a process one level up.
+static const int nicewt[] = {
+  88761, 71755, 56483, 46273, 36291,
+  29154, 23254, 18705, 14949, 11916,
+   9548,  7620,  6100,  4904,  3906,
+   3121,  2501,  1991,  1586,  1277,
+   1024,   820,   655,   526,   423,
+    335,   272,   215,   172,   137,
+    110,    87,    70,    56,    45,
+     36,    29,    23,    18,    15,
+};
+#define NICE0WT 1024
+
+// sleeping processes, hashed by the channel they sleep on,
+// so that wakeup() only looks at processes that might be
+// sleeping on its channel. each queue is FIFO.
+// lock order: waitq[].lock before p->lock.
+#define NWAITQ 61
+
+#define NODEADLINE (~0U)
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;
+} waitq[NWAITQ];
+
 struct proc *initproc;
 
 int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kthreadret(void);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
@@ -26,20 +95,24 @@ extern char trampoline[]; // trampoline.S
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
+// Allocate a page for each process's kernel stack, all
+// of them in one block from kalloc_order(), which they
+// keep for good. Map each high in memory, followed by an
+// invalid guard page.
 void
 proc_mapstacks(pagetable_t kpgtbl)
 {
   struct proc *p;
-  
+  int order = 0;
+  char *pa;
+
+  while((1 << order) < NPROC)
+    order++;
+  if(order > MAXORDER || (pa = kalloc_order(order)) == 0)
+    panic("kalloc");
   for(p = proc; p < &proc[NPROC]; p++) {
-    char *pa = kalloc();
-    if(pa == 0)
-      panic("kalloc");
     uint64 va = KSTACK((int) (p - proc));
-    kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
+    kvmmap(kpgtbl, va, (uint64)pa + (p - proc)*PGSIZE, PGSIZE, PTE_R | PTE_W);
   }
 }
 
@@ -51,6 +124,12 @@ procinit(void)
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  for(int i = 0; i < NCPU; i++){
+    initlock(&runq[i].lock, "runq");
+    cpus[i].deadline = NODEADLINE;
+  }
+  for(int i = 0; i < NWAITQ; i++)
+    initlock(&waitq[i].lock, "waitq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->state = UNUSED;
@@ -124,6 +203,13 @@ allocproc(void)
 found:
   p->pid = allocpid();
   p->state = USED;
+  p->cpu = cpuid();
+  p->policy = SCHED_FAIR;
+  p->prio = 0;
+  p->vruntime = 0;
+  p->affinity = ALLCPUS;
+  p->lastcpu = -1;
+  p->nmigrate = 0;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -168,6 +254,7 @@ freeproc(struct proc *p)
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->kfn = 0;
   p->state = UNUSED;
 }
 
@@ -228,6 +315,302 @@ uchar initcode[] = {
   0x00, 0x00, 0x00, 0x00
 };
 
+// Arm CPU id's timer for what it needs next: the end of the
+// quantum of the process it runs, if another is waiting, its
+// earliest sleepticks() deadline, and when a process it was
+// refused by stealable() cools down. Caller must hold
+// runq[id].lock.
+static void
+timerarm(int id)
+{
+  struct cpu *c = &cpus[id];
+  uint64 when = ~0ULL;
+
+  // a SCHED_FIFO process keeps the CPU until it gives it up,
+  // or a higher priority one arrives (see enqueue()).
+  if(c->proc && c->proc->policy == SCHED_FAIR && runq[id].n > 0)
+    when = timernow() + TICKCYCLES;
+  if(c->deadline != NODEADLINE && (uint64)c->deadline * TICKCYCLES < when)
+    when = (uint64)c->deadline * TICKCYCLES;
+  if(c->stealat && c->stealat < when)
+    when = c->stealat;
+  timerset(id, when);
+}
+
+// Get the attention of an idle CPU, if there is one, so
+// that it steals work from a busy CPU's queue.
+static void
+kickidle(void)
+{
+  for(int i = 0; i < NCPU; i++){
+    if(__atomic_load_n(&cpus[i].idle, __ATOMIC_RELAXED) == 0)
+      continue;
+    acquire(&runq[i].lock);
+    if(cpus[i].idle){
+      timerset(i, 0);
+      release(&runq[i].lock);
+      return;
+    }
+    release(&runq[i].lock);
+  }
+}
+
+static void
+heapswap(struct runq *q, int i, int j)
+{
+  struct proc *t = q->fair[i];
+
+  q->fair[i] = q->fair[j];
+  q->fair[j] = t;
+}
+
+static void
+siftup(struct runq *q, int i)
+{
+  while(i > 0 && q->fair[(i-1)/2]->vruntime > q->fair[i]->vruntime){
+    heapswap(q, i, (i-1)/2);
+    i = (i-1)/2;
+  }
+}
+
+static void
+siftdown(struct runq *q, int i)
+{
+  int l;
+
+  while((l = 2*i + 1) < q->nfair){
+    if(l + 1 < q->nfair && q->fair[l+1]->vruntime < q->fair[l]->vruntime)
+      l++;
+    if(q->fair[i]->vruntime <= q->fair[l]->vruntime)
+      break;
+    heapswap(q, i, l);
+    i = l;
+  }
+}
+
+static void
+heappush(struct runq *q, struct proc *p)
+{
+  q->fair[q->nfair] = p;
+  siftup(q, q->nfair++);
+}
+
+// Remove and return the i'th process in q's heap.
+static struct proc*
+heapremove(struct runq *q, int i)
+{
+  struct proc *p = q->fair[i];
+
+  q->fair[i] = q->fair[--q->nfair];
+  if(i < q->nfair){
+    siftup(q, i);
+    siftdown(q, i);
+  }
+  return p;
+}
+
+// The online CPU in mask with the fewest processes queued.
+static int
+leastloaded(int mask)
+{
+  int best = -1;
+
+  mask &= __atomic_load_n(&cpuonline, __ATOMIC_RELAXED);
+  for(int i = 0; i < NCPU; i++){
+    if((mask & (1 << i)) == 0)
+      continue;
+    if(best < 0 || runq[i].n < runq[best].n)
+      best = i;
+  }
+  return best < 0 ? 0 : best;
+}
+
+// Put p, which is RUNNABLE, on its CPU's run queue.
+// Caller must hold p->lock.
+static void
+enqueue(struct proc *p)
+{
+  struct runq *q = &runq[p->cpu];
+  struct cpu *c = &cpus[p->cpu];
+  struct proc *cur, **pp;
+  int steal = 0;
+
+  // p goes back to the CPU it last ran on, whose cache
+  // may still hold some of its memory, if it may run there.
+  if((p->affinity & (1 << p->cpu)) == 0){
+    p->cpu = leastloaded(p->affinity);
+    q = &runq[p->cpu];
+    c = &cpus[p->cpu];
+  }
+
+  acquire(&q->lock);
+  if(p->policy == SCHED_FIFO){
+    for(pp = &q->rt; *pp && (*pp)->prio >= p->prio; pp = &(*pp)->rqnext)
+      ;
+    p->rqnext = *pp;
+    *pp = p;
+  } else {
+    if(p->vruntime + TICKCYCLES < q->minvruntime)
+      p->vruntime = q->minvruntime - TICKCYCLES;
+    heappush(q, p);
+  }
+  __atomic_store_n(&q->n, q->n + 1, __ATOMIC_RELAXED);
+
+  // make sure the queue's CPU notices: interrupt it at
+  // once if it is idle or p should preempt what it runs,
+  // and otherwise by the end of its quantum, or sooner
+  // for a process that just woke up.
+  cur = c->proc;
+  if(c->idle){
+    timerset(p->cpu, 0);
+  } else if(cur && cur != p && p->policy == SCHED_FIFO &&
+            (cur->policy == SCHED_FAIR || cur->prio < p->prio)){
+    timerset(p->cpu, 0);
+  } else {
+    uint64 when = timernow() + (p->woken ? WAKEGRAN : TICKCYCLES);
+    if(cur == 0 || cur->policy == SCHED_FAIR)
+      if(timerget(p->cpu) > when)
+        timerset(p->cpu, when);
+    // unless this CPU is about to give itself up to p,
+    // an idle CPU could run p sooner.
+    steal = q->n > 1 || p->cpu != cpuid();
+  }
+  release(&q->lock);
+
+  if(steal)
+    kickidle();
+}
+
+// Make p RUNNABLE and put it on its CPU's run queue.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  p->state = RUNNABLE;
+  enqueue(p);
+}
+
+// Is p allowed on CPU thief, and not likely to still have
+// its memory in the cache of the CPU it last ran on? A hot
+// process may be stolen only if the victim's queue is long.
+// If p is too hot, have thief come back for it once it has
+// cooled down, since nothing else may wake thief up.
+static int
+stealable(struct runq *q, struct proc *p, int thief)
+{
+  struct cpu *c = &cpus[thief];
+  uint64 cold;
+
+  if((p->affinity & (1 << thief)) == 0)
+    return 0;
+  if(q->n > 1 || timernow() - p->lastran > CACHEHOT)
+    return 1;
+  cold = p->lastran + CACHEHOT + 1;
+  if(c->stealat == 0 || cold < c->stealat)
+    c->stealat = cold;
+  return 0;
+}
+
+// Take the next process to run off CPU id's run queue, or 0.
+// If CPU thief is stealing it, take one that the queue's
+// CPU would run last instead, and move it to thief's
+// virtual time.
+static struct proc*
+dequeue(int id, int thief)
+{
+  struct runq *q = &runq[id];
+  struct proc *p = 0, **pp;
+  int i;
+
+  // a racy peek, so that idle CPUs don't fight over
+  // the locks of empty queues.
+  if(__atomic_load_n(&q->n, __ATOMIC_RELAXED) == 0)
+    return 0;
+  acquire(&q->lock);
+  if(thief == id){
+    if((p = q->rt) != 0)
+      q->rt = p->rqnext;
+    else if(q->nfair > 0){
+      p = heapremove(q, 0);
+      if(p->vruntime > q->minvruntime)
+        q->minvruntime = p->vruntime;
+    }
+  } else {
+    for(i = q->nfair - 1; i >= 0; i--)
+      if(stealable(q, q->fair[i], thief))
+        break;
+    if(i >= 0){
+      p = heapremove(q, i);
+      // thief's minvruntime only changes on thief.
+      long lag = p->vruntime - q->minvruntime;
+      uint64 base = runq[thief].minvruntime;
+      p->vruntime = (lag < 0 && -lag > base) ? 0 : base + lag;
+    } else {
+      for(pp = &q->rt; *pp && !stealable(q, *pp, thief); pp = &(*pp)->rqnext)
+        ;
+      if((p = *pp) != 0)
+        *pp = p->rqnext;
+    }
+  }
+  if(p)
+    __atomic_store_n(&q->n, q->n - 1, __ATOMIC_RELAXED);
+  release(&q->lock);
+  return p;
+}
+
+// Find a process for CPU id to run: the next one on its
+// own queue, or else one from the longest other queue.
+static struct proc*
+pickproc(int id)
+{
+  struct proc *p;
+  int victim, n, most;
+
+  cpus[id].stealat = 0;
+  if((p = dequeue(id, id)) != 0)
+    return p;
+
+  victim = -1;
+  most = 0;
+  for(int i = 1; i < NCPU; i++){
+    int j = (id + i) % NCPU;
+    n = __atomic_load_n(&runq[j].n, __ATOMIC_RELAXED);
+    if(n > most){
+      victim = j;
+      most = n;
+    }
+  }
+  if(victim < 0)
+    return 0;
+  return dequeue(victim, id);
+}
+
+// Nothing to run: wait for an interrupt, with the timer
+// armed only for sleepticks() deadlines and processes to
+// steal once they cool down. setrunnable()
+// interrupts an idle CPU when it gives it work.
+static void
+idle(int id)
+{
+  struct runq *q = &runq[id];
+  struct cpu *c = &cpus[id];
+
+  // with interrupts off, so that an interrupt between
+  // deciding to wait and waiting isn't taken and lost;
+  // wfi still returns when one is pending.
+  intr_off();
+  acquire(&q->lock);
+  if(q->n == 0){
+    __atomic_store_n(&c->idle, 1, __ATOMIC_RELAXED);
+    timerarm(id);
+    release(&q->lock);
+    wfi();
+    acquire(&q->lock);
+    __atomic_store_n(&c->idle, 0, __ATOMIC_RELAXED);
+  }
+  release(&q->lock);
+}
+
 // Set up first user process.
 void
 userinit(void)
@@ -249,9 +632,41 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
+
+  release(&p->lock);
+}
+
+// Start a kernel thread that runs fn(), which must not return.
+// It is a process that never leaves the kernel: it has no user
+// memory, no open files and no parent.
+// Returns its pid, or -1.
+int
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
 
+  if((p = allocproc()) == 0)
+    return -1;
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  setrunnable(p);
   release(&p->lock);
+  return p->pid;
+}
+
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+  p->kfn();
+  panic("kthread returned");
 }
 
 // Grow or shrink user memory by n bytes.
@@ -264,9 +679,16 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    // only reserve the address space. vmfault()
+    // allocates each page when it is first touched.
+    // the heap must stay below the mmap() regions.
+    uint64 top = TRAPFRAME;
+    for(struct vma *v = p->vma; v < &p->vma[NVMA]; v++)
+      if(v->end != 0 && v->start >= sz && v->start < top)
+        top = v->start;
+    if(sz + n < sz || sz + n > top)
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
@@ -289,12 +711,17 @@ fork(void)
   }
 
   // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  if(uvmcopy(p->pagetable, np->pagetable, 0, p->sz) < 0){
     freeproc(np);
     release(&np->lock);
     return -1;
   }
   np->sz = p->sz;
+  if(vmacopy(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -310,6 +737,13 @@ fork(void)
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
+  // the child inherits the scheduling class, and starts
+  // out level with the parent.
+  np->policy = p->policy;
+  np->prio = p->prio;
+  np->vruntime = p->vruntime;
+  np->affinity = p->affinity;
+
   pid = np->pid;
 
   release(&np->lock);
@@ -319,7 +753,7 @@ fork(void)
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
@@ -351,6 +785,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Write back and drop mmap()ed and program memory regions.
+  vmaunmap(p, 0, MAXVA);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -394,6 +831,8 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  if(addr != 0)
+    vmprefault(addr, sizeof(pp->xstate));
   acquire(&wait_lock);
 
   for(;;){
@@ -446,33 +885,65 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
   
   c->proc = 0;
+  __atomic_fetch_or(&cpuonline, 1 << id, __ATOMIC_RELAXED);
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-      }
+    if((p = pickproc(id)) == 0){
+      idle(id);
+      continue;
+    }
+
+    // the process may still be on its way out of the CPU
+    // that queued it; its lock is held until it gets there.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler: not runnable");
+    if((p->affinity & (1 << id)) == 0){
+      // its affinity changed while it was queued here.
+      enqueue(p);
       release(&p->lock);
+      continue;
     }
+    // count a migration once, when it comes true.
+    if(p->lastcpu >= 0 && p->lastcpu != id)
+      p->nmigrate++;
+    p->lastcpu = id;
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    p->cpu = id;
+    p->runstart = timernow();
+    c->proc = p;
+    acquire(&runq[id].lock);
+    if(p->woken){
+      uint64 t = timernow() - p->woken;
+      c->nwake++;
+      c->waketotal += t;
+      if(t > c->wakemax)
+        c->wakemax = t;
+      p->woken = 0;
+    }
+    timerarm(id);
+    release(&runq[id].lock);
+    swtch(&c->context, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
 // Switch to scheduler.  Must hold only p->lock
-// and have changed proc->state. Saves and restores
+// and have changed proc->state. A RUNNABLE p
+// goes back on the run queue. Saves and restores
 // intena because intena is a property of this
 // kernel thread, not this CPU. It should
 // be proc->intena and proc->noff, but that would
@@ -493,6 +964,14 @@ sched(void)
   if(intr_get())
     panic("sched interruptible");
 
+  // charge p for the time it ran, before it can be
+  // queued again by vruntime.
+  p->lastran = timernow();
+  if(p->policy == SCHED_FAIR)
+    p->vruntime += (p->lastran - p->runstart) * NICE0WT / nicewt[p->prio - NICE_MIN];
+  if(p->state == RUNNABLE)
+    enqueue(p);
+
   intena = mycpu()->intena;
   swtch(&p->context, &mycpu()->context);
   mycpu()->intena = intena;
@@ -530,30 +1009,44 @@ forkret(void)
   usertrapret();
 }
 
+static struct waitq*
+waitqueue(void *chan)
+{
+  return &waitq[((uint64)chan >> 2) % NWAITQ];
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct waitq *q = waitqueue(chan);
+  struct proc **pp;
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold q->lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks q->lock),
   // so it's okay to release lk.
 
+  acquire(&q->lock);
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->wqnext = 0;
+  for(pp = &q->head; *pp; pp = &(*pp)->wqnext)
+    ;
+  *pp = p;
+  release(&q->lock);
 
   sched();
 
-  // Tidy up.
+  // Tidy up. Whoever woke us took us off q.
   p->chan = 0;
 
   // Reacquire original lock.
@@ -561,22 +1054,95 @@ sleep(void *chan, struct spinlock *lk)
   acquire(lk);
 }
 
+// Wake up processes sleeping on chan: all of them, or
+// only the one that has slept longest if one is set.
+static void
+wakechan(void *chan, int one)
+{
+  struct waitq *q = waitqueue(chan);
+  struct proc **pp, *p;
+
+  acquire(&q->lock);
+  pp = &q->head;
+  while((p = *pp) != 0){
+    if(p->chan != chan){
+      pp = &p->wqnext;
+      continue;
+    }
+    *pp = p->wqnext;
+    acquire(&p->lock);
+    p->woken = timernow();
+    setrunnable(p);
+    release(&p->lock);
+    if(one)
+      break;
+  }
+  release(&q->lock);
+}
+
 // Wake up all processes sleeping on chan.
 // Must be called without any p->lock.
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  wakechan(chan, 0);
+}
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
-      acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-    }
+// Wake up one process sleeping on chan. For channels whose
+// sleepers each consume something that the waker produced;
+// a sleeper that leaves some over must pass it on with
+// another wakeup_one().
+// Must be called without any p->lock.
+void
+wakeup_one(void *chan)
+{
+  wakechan(chan, 1);
+}
+
+// Sleep on &ticks until woken, and at the latest once ticks
+// reaches deadline. Caller must hold tickslock, and should
+// check ticks again when woken, since clockintr() wakes all
+// the sleepers on &ticks when any of them is due.
+void
+sleepticks(uint deadline)
+{
+  struct cpu *c;
+  int id;
+
+  // the deadline goes to this CPU, whose scheduler arms
+  // the timer for it as this process goes to sleep.
+  push_off();
+  id = cpuid();
+  c = &cpus[id];
+  acquire(&runq[id].lock);
+  if(deadline < c->deadline)
+    c->deadline = deadline;
+  release(&runq[id].lock);
+  pop_off();
+
+  sleep(&ticks, &tickslock);
+}
+
+// Called by clockintr(): has this CPU's earliest sleepticks()
+// deadline come? If so, forget it, since the sleepers woken
+// give their deadlines again if they sleep on.
+int
+deadlinepassed(uint now)
+{
+  struct cpu *c;
+  int id, passed = 0;
+
+  push_off();
+  id = cpuid();
+  c = &cpus[id];
+  acquire(&runq[id].lock);
+  if(c->deadline != NODEADLINE && now >= c->deadline){
+    c->deadline = NODEADLINE;
+    passed = 1;
   }
+  release(&runq[id].lock);
+  pop_off();
+  return passed;
 }
 
 // Kill the process with the given pid.
@@ -585,16 +1151,34 @@ wakeup(void *chan)
 int
 kill(int pid)
 {
-  struct proc *p;
+  struct proc *p, **pp;
+  struct waitq *q;
+  void *chan;
 
   for(p = proc; p < &proc[NPROC]; p++){
     acquire(&p->lock);
     if(p->pid == pid){
       p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
+      // Wake process from sleep(). Taking it off its
+      // wait queue needs that queue's lock first.
+      while(p->state == SLEEPING && p->pid == pid){
+        chan = p->chan;
+        release(&p->lock);
+        q = waitqueue(chan);
+        acquire(&q->lock);
+        acquire(&p->lock);
+        if(p->state == SLEEPING && p->chan == chan){
+          for(pp = &q->head; *pp != p; pp = &(*pp)->wqnext)
+            ;
+          *pp = p->wqnext;
+          setrunnable(p);
+        }
+        release(&q->lock);
       }
+      // a CPU running nothing else takes no timer interrupts,
+      // so interrupt it to have the victim notice.
+      if(p->state == RUNNING && p->pid == pid)
+        timerset(p->cpu, 0);
       release(&p->lock);
       return 0;
     }
@@ -678,6 +1262,141 @@ procdump(void)
     else
       state = "???";
     printf("%d %s %s", p->pid, state, p->name);
+    printf(" cpu %d migrations %d", p->cpu, p->nmigrate);
     printf("\n");
   }
+  schedstat();
+  bstat();
+  virtio_disk_stat();
+}
+
+// Print each CPU's run queue length, and how long processes
+// took to get a CPU after wakeup(), in microseconds (the
+// CLINT's clock counts at 10MHz in qemu). For debugging.
+void
+schedstat(void)
+{
+  struct cpu *c;
+
+  for(int i = 0; i < NCPU; i++){
+    c = &cpus[i];
+    if(c->nwake == 0 && runq[i].n == 0)
+      continue;
+    printf("cpu %d: %d runnable, %d wakeups, latency avg %d max %d us\n",
+           i, runq[i].n, (int)c->nwake,
+           c->nwake ? (int)(c->waketotal / c->nwake / 10) : 0,
+           (int)(c->wakemax / 10));
+  }
+}
+
+// Find the process with the given pid, or the caller if pid
+// is 0, and return it locked, or 0.
+static struct proc*
+lockpid(int pid)
+{
+  struct proc *p;
+
+  if(pid == 0){
+    p = myproc();
+    acquire(&p->lock);
+    return p;
+  }
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED)
+      return p;
+    release(&p->lock);
+  }
+  return 0;
+}
+
+// Put process pid in scheduling class policy with priority
+// prio (see sched.h). A queued process moves to its new
+// class the next time it is queued.
+// Returns 0, or -1 if there is no such process or the
+// priority is out of range.
+int
+setpriority(int pid, int policy, int prio)
+{
+  struct proc *p;
+
+  if(policy == SCHED_FAIR){
+    if(prio < NICE_MIN || prio > NICE_MAX)
+      return -1;
+  } else if(policy == SCHED_FIFO){
+    if(prio < 1 || prio > RTPRIO_MAX)
+      return -1;
+  } else {
+    return -1;
+  }
+
+  if((p = lockpid(pid)) == 0)
+    return -1;
+  p->policy = policy;
+  p->prio = prio;
+  release(&p->lock);
+  return 0;
+}
+
+// Return the scheduling class of process pid, and set *prio
+// to its priority, or return -1 if there is no such process.
+int
+getpriority(int pid, int *prio)
+{
+  struct proc *p;
+  int policy;
+
+  if((p = lockpid(pid)) == 0)
+    return -1;
+  policy = p->policy;
+  *prio = p->prio;
+  release(&p->lock);
+  return policy;
+}
+
+// Let process pid (or the caller, if pid is 0) run only on
+// the CPUs in mask, a bit per CPU. If it runs elsewhere now,
+// it moves at its next trip through the scheduler, which is
+// hurried along. Returns 0, or -1 if there is no such process
+// or mask holds no CPU that is up.
+int
+setaffinity(int pid, int mask)
+{
+  struct proc *p;
+
+  if((mask & ALLCPUS & __atomic_load_n(&cpuonline, __ATOMIC_RELAXED)) == 0)
+    return -1;
+  if((p = lockpid(pid)) == 0)
+    return -1;
+  p->affinity = mask & ALLCPUS;
+  if(p->state == RUNNING && (p->affinity & (1 << p->cpu)) == 0)
+    timerset(p->cpu, 0);
+  release(&p->lock);
+  return 0;
+}
+
+// Return the CPU mask of process pid, or -1.
+int
+getaffinity(int pid)
+{
+  struct proc *p;
+  int mask;
+
+  if((p = lockpid(pid)) == 0)
+    return -1;
+  mask = p->affinity;
+  release(&p->lock);
+  return mask;
+}
+
+// Return the CPU the caller is running on.
+int
+getcpu(void)
+{
+  int id;
+
+  push_off();
+  id = cpuid();
+  pop_off();
+  return id;
 }
@@ -24,6 +24,16 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+
+  // the CPU's run queue lock must be held when using these:
+  int idle;                   // Waiting for an interrupt in idle()?
+  uint deadline;              // Earliest tick a sleepticks() caller wants
+  uint64 nwake;               // Wakeups dispatched, and their latency
+  uint64 waketotal;           //   in timer cycles
+  uint64 wakemax;
+
+  // only used by the CPU itself:
+  uint64 stealat;             // When a process it may not steal yet cools, or 0
 };
 
 extern struct cpu cpus[NCPU];
@@ -81,6 +91,20 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A region of user memory whose pages are allocated, and read
+// in from a file if there is one, the first time they are
+// touched (see vmfault() in vm.c). exec() describes each ELF
+// segment with one, and mmap() creates them above p->sz.
+struct vma {
+  uint64 start;       // first address, page-aligned
+  uint64 end;         // one past the last address, page-aligned; 0 if unused
+  int perm;           // PTE_R, PTE_W, PTE_X
+  int flags;          // MAP_SHARED or MAP_PRIVATE, and MAP_ANONYMOUS
+  struct inode *ip;   // file the pages come from; 0 if anonymous
+  uint off;           // file offset of start
+  uint filesz;        // bytes backed by the file; the rest reads as zero
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -91,6 +115,22 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // CPU it runs on, or whose run queue it is on
+  int lastcpu;                 // CPU it last ran on, or -1
+  uint64 woken;                // When wakeup() made it RUNNABLE, or 0
+  int policy;                  // Scheduling class (see sched.h)
+  int prio;                    // Nice value, or SCHED_FIFO priority
+  uint64 runstart;             // When it last got a CPU
+  uint64 lastran;              // When it last gave up a CPU
+  int affinity;                // CPUs it may run on, a bit per CPU
+  int nmigrate;                // Times it moved to another CPU
+
+  // p->lock, or while p is RUNNABLE its run queue's lock:
+  uint64 vruntime;             // Weighted time run, for SCHED_FAIR
+
+  // the run or wait queue's lock must be held when using these:
+  struct proc *rqnext;         // Next process on the run queue
+  struct proc *wqnext;         // Next process sleeping in the wait queue
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
@@ -103,5 +143,8 @@ struct proc {
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // Demand-paged memory regions
+  void (*kfn)(void);           // Kernel thread's function, or 0
+  int logres;                  // Log blocks reserved by begin_op()
   char name[16];               // Process name (debugging)
 };
@@ -0,0 +1,8 @@
+// Scheduling classes, for setpriority() and getpriority().
+#define SCHED_FAIR  0   // share the CPU by weight; the priority is a nice value
+#define SCHED_FIFO  1   // real time: run before any SCHED_FAIR process until
+                        // blocking; the priority is 1..RTPRIO_MAX, higher first
+
+#define NICE_MIN    (-20)  // largest share of the CPU
+#define NICE_MAX    19     // smallest
+#define RTPRIO_MAX  99
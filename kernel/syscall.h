@@ -22,3 +22,11 @@
 #define SYS_close   21
 #define SYS_opendfd 22
 #define SYS_net_send 23
+#define SYS_mmap    24
+#define SYS_munmap  25
+#define SYS_setpriority 26
+#define SYS_getpriority 27
+#define SYS_sched_setaffinity 28
+#define SYS_sched_getaffinity 29
+#define SYS_sched_getcpu 30
+#define SYS_uptimeus 31
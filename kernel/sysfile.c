@@ -8,6 +8,7 @@
 #include "riscv.h"
 #include "defs.h"
 #include "param.h"
+#include "memlayout.h"
 #include "stat.h"
 #include "spinlock.h"
 #include "proc.h"
@@ -170,16 +171,18 @@ bad:
 }
 
 // Is the directory dp empty except for "." and ".." ?
+// They are not always the first two entries: an indexed
+// directory keeps them wherever their hash puts them.
 static int
 isdirempty(struct inode *dp)
 {
   int off;
   struct dirent de;
 
-  for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
+  for(off=0; off<dp->size; off+=sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("isdirempty: readi");
-    if(de.inum != 0)
+    if(de.inum != 0 && namecmp(de.name, ".") != 0 && namecmp(de.name, "..") != 0)
       return 0;
   }
   return 1;
@@ -222,6 +225,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcadd(dp, name, 0, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -504,6 +508,89 @@ sys_pipe(void)
   return 0;
 }
 
+// Map len bytes of a file, starting at page-aligned offset off,
+// or of zeroed memory if MAP_ANONYMOUS, into the address space
+// just below the lowest existing mapping. addr is only a hint
+// and is ignored. Pages are read in when first touched.
+uint64
+sys_mmap(void)
+{
+  uint64 addr, len, off, top;
+  int prot, flags;
+  struct file *f = 0;
+  struct vma *v, *nv = 0;
+  struct proc *p = myproc();
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argaddr(5, &off);
+
+  if(len == 0 || len > MAXVA || off % PGSIZE != 0 || (uint)off != off)
+    return -1;
+  if(prot & ~(PROT_READ|PROT_WRITE|PROT_EXEC))
+    return -1;
+  if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+    return -1;
+  if((flags & MAP_ANONYMOUS) == 0){
+    if(argfd(4, 0, &f) < 0 || f->type != FD_INODE || f->readable == 0)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && f->writable == 0)
+      return -1;
+  }
+  len = PGROUNDUP(len);
+  // file offsets are uints; the mapping must not wrap past 4GB.
+  if(f && (uint)(off + len) != off + len)
+    return -1;
+
+  top = TRAPFRAME;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0){
+      if(nv == 0)
+        nv = v;
+    } else if(v->start >= p->sz && v->start < top){
+      top = v->start;
+    }
+  }
+  if(nv == 0 || top - PGROUNDUP(p->sz) < len)
+    return -1;
+
+  nv->start = top - len;
+  nv->end = top;
+  nv->perm = PTE_R;
+  if(prot & PROT_WRITE)
+    nv->perm |= PTE_W;
+  if(prot & PROT_EXEC)
+    nv->perm |= PTE_X;
+  nv->flags = flags & (MAP_SHARED|MAP_PRIVATE|MAP_ANONYMOUS);
+  nv->ip = f ? idup(f->ip) : 0;
+  nv->off = off;
+  nv->filesz = 0;
+  if(f){
+    // pages past the end of the file read as zero.
+    ilock(f->ip);
+    if(f->ip->size > off)
+      nv->filesz = f->ip->size - off < len ? f->ip->size - off : len;
+    iunlock(f->ip);
+  }
+  return nv->start;
+}
+
+// Unmap [addr, addr+len), writing dirty pages of shared
+// file mappings back first.
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  if(addr % PGSIZE != 0 || len == 0)
+    return -1;
+  return vmaunmap(myproc(), addr, len);
+}
+
 ushort
 sys_opendfd(void)
 {
@@ -56,13 +56,13 @@ sys_sleep(void)
 
   argint(0, &n);
   acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
+  ticks0 = tickupdate();
+  while(tickupdate() - ticks0 < n){
     if(killed(myproc())){
       release(&tickslock);
       return -1;
     }
-    sleep(&ticks, &tickslock);
+    sleepticks(ticks0 + n);
   }
   release(&tickslock);
   return 0;
@@ -77,7 +77,7 @@ sys_kill(void)
   return kill(pid);
 }
 
-// return how many clock tick interrupts have occurred
+// return how many clock ticks have passed
 // since start.
 uint64
 sys_uptime(void)
@@ -85,7 +85,67 @@ sys_uptime(void)
   uint xticks;
 
   acquire(&tickslock);
-  xticks = ticks;
+  xticks = tickupdate();
   release(&tickslock);
   return xticks;
 }
+
+// return how many microseconds have passed since
+// start, for timing what takes less than a tick.
+// a tick is 1/10th second, TICKCYCLES timer cycles.
+uint64
+sys_uptimeus(void)
+{
+  return timernow() / (TICKCYCLES / 100000);
+}
+
+uint64
+sys_setpriority(void)
+{
+  int pid, policy, prio;
+
+  argint(0, &pid);
+  argint(1, &policy);
+  argint(2, &prio);
+  return setpriority(pid, policy, prio);
+}
+
+uint64
+sys_getpriority(void)
+{
+  int pid, policy, prio;
+  uint64 addr;
+
+  argint(0, &pid);
+  argaddr(1, &addr);
+  if((policy = getpriority(pid, &prio)) < 0)
+    return -1;
+  if(copyout(myproc()->pagetable, addr, (char*)&prio, sizeof(prio)) < 0)
+    return -1;
+  return policy;
+}
+
+uint64
+sys_sched_setaffinity(void)
+{
+  int pid, mask;
+
+  argint(0, &pid);
+  argint(1, &mask);
+  return setaffinity(pid, mask);
+}
+
+uint64
+sys_sched_getaffinity(void)
+{
+  int pid;
+
+  argint(0, &pid);
+  return getaffinity(pid);
+}
+
+uint64
+sys_sched_getcpu(void)
+{
+  return getcpu();
+}
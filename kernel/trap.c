@@ -65,6 +65,18 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if(r_scause() == 12 || r_scause() == 13 || r_scause() == 15){
+    // page fault. the page may be lazily allocated, copy-on-write,
+    // or not yet read in from the program file, which sleeps, so
+    // enable interrupts as for a system call.
+    uint64 scause = r_scause();
+    uint64 va = r_stval();
+    intr_on();
+    if(vmfault(p->pagetable, va, scause == 15) < 0){
+      printf("usertrap(): page fault %p pid=%d\n", scause, p->pid);
+      printf("            sepc=%p stval=%p\n", p->trapframe->epc, va);
+      setkilled(p);
+    }
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -160,12 +172,45 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
+// Program hart id's timer to interrupt once the CLINT's
+// clock reaches when; ~0 disarms it. Any hart may program
+// any other's, which is how the scheduler wakes idle harts.
+void
+timerset(int id, uint64 when)
+{
+  *(volatile uint64*)CLINT_MTIMECMP(id) = when;
+}
+
+uint64
+timerget(int id)
+{
+  return *(volatile uint64*)CLINT_MTIMECMP(id);
+}
+
+// cycles since boot.
+uint64
+timernow(void)
+{
+  return *(volatile uint64*)CLINT_MTIME;
+}
+
+// Bring ticks up to date with the CLINT's clock. Harts
+// don't take an interrupt every tick, so ticks is only
+// current after this. Caller must hold tickslock.
+uint
+tickupdate(void)
+{
+  ticks = timernow() / TICKCYCLES;
+  return ticks;
+}
+
 void
 clockintr()
 {
   acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
+  tickupdate();
+  if(deadlinepassed(ticks))
+    wakeup(&ticks);
   release(&tickslock);
 }
 
@@ -205,9 +250,7 @@ devintr()
     // software interrupt from a machine-mode timer interrupt,
     // forwarded by timervec in kernelvec.S.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
+    clockintr();
     
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
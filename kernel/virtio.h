@@ -55,6 +55,10 @@
 // must be a power of two.
 #define NUM 8
 
+// the disk's queue is larger. each request takes one entry,
+// which points to an indirect table of descriptors.
+#define DNUM 64
+
 // a single descriptor, from the spec.
 struct virtq_desc {
     uint64 addr;
@@ -62,6 +66,7 @@ struct virtq_desc {
 
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // addr is a table of descriptors
     uint16 flags;
     uint16 next;
 };
@@ -71,8 +76,8 @@ struct virtq_avail {
 #define VRING_AVAIL_F_NO_INTERRUPT 1
     uint16 flags; // always zero
     uint16 idx;   // driver will write ring[idx] next
-    uint16 ring[NUM]; // descriptor numbers of chain heads (2bytes/elem)
-    uint16 unused;
+    uint16 ring[]; // descriptor numbers of chain heads (2bytes/elem),
+                   // as many as the queue has entries
 };
 
 // one entry in the "used" ring, with which the
@@ -86,7 +91,7 @@ struct virtq_used {
 #define VRING_USED_F_NO_NOTIFY 1
     uint16 flags; // always zero
     uint16 idx;   // device increments when it adds a ring[] entry
-    struct virtq_used_elem ring[NUM];
+    struct virtq_used_elem ring[]; // as many as the queue has entries
 };
 
 struct virtq {
@@ -4,6 +4,15 @@
 //
 // qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
 //
+// transfers are not handed to the device one by one. they wait
+// in a queue sorted by block number, and a run of up to NSEG
+// queued transfers of consecutive blocks in the same direction
+// goes to the device as a single request, with one data
+// descriptor per buf. callers that are about to start a batch
+// of transfers bracket it with virtio_disk_plug() and
+// virtio_disk_unplug(), so that the whole batch is queued and
+// merged before the device is told about any of it.
+//
 
 #include "types.h"
 #include "riscv.h"
@@ -19,40 +28,53 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
+// most bufs merged into one request.
+#define NSEG 16
+
 static struct disk {
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
-  // disk operations. there are NUM descriptors.
-  // most commands consist of a "chain" (a linked list) of a couple of
-  // these descriptors.
+  // disk operations. there are DNUM descriptors.
+  // each request uses exactly one, which points to the
+  // request's own indirect table of descriptors.
   struct virtq_desc *desc;
 
   // a ring in which the driver writes descriptor numbers
-  // that the driver would like the device to process.  it only
-  // includes the head descriptor of each chain. the ring has
-  // NUM elements.
+  // that the driver would like the device to process. the
+  // ring has DNUM elements.
   struct virtq_avail *avail;
 
   // a ring in which the device writes descriptor numbers that
-  // the device has finished processing (just the head of each chain).
-  // there are NUM used ring entries.
+  // the device has finished processing.
+  // there are DNUM used ring entries.
   struct virtq_used *used;
 
   // our own book-keeping.
-  char free[NUM];  // is a descriptor free?
-  uint16 used_idx; // we've looked this far in used[2..NUM].
+  char free[DNUM];  // is a descriptor free?
+  uint16 used_idx; // we've looked this far in used[2..DNUM].
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
-  // indexed by first descriptor index of chain.
+  // indexed by descriptor.
   struct {
-    struct buf *b;
+    struct buf *b;  // bufs of the request, linked by qnext
     char status;
-  } info[NUM];
+  } info[DNUM];
 
-  // disk command headers.
+  // disk command headers, and the indirect descriptor
+  // tables: header, up to NSEG data, one-byte status.
   // one-for-one with descriptors, for convenience.
-  struct virtio_blk_req ops[NUM];
+  struct virtio_blk_req ops[DNUM];
+  struct virtq_desc ind[DNUM][NSEG+2];
+
+  // transfers not yet handed to the device, sorted
+  // by block number, linked by qnext.
+  struct buf *queue;
+  int plugged;   // hold back the queue while > 0
+
+  uint nreq;     // requests handed to the device
+  uint nbuf;     // bufs in those requests
+  uint nnotify;  // device notifications
   
   struct spinlock vdisk_lock;
   
@@ -91,7 +113,8 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
   features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
+  if(!(features & (1 << VIRTIO_RING_F_INDIRECT_DESC)))
+    panic("virtio disk has no indirect descriptors");
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
 
   // tell device that feature negotiation is complete.
@@ -114,7 +137,7 @@ virtio_disk_init(void)
   uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
   if(max == 0)
     panic("virtio disk has no queue 0");
-  if(max < NUM)
+  if(max < DNUM)
     panic("virtio disk max queue too short");
 
   // allocate and zero queue memory.
@@ -128,7 +151,7 @@ virtio_disk_init(void)
   memset(disk.used, 0, PGSIZE);
 
   // set queue size.
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  *R(VIRTIO_MMIO_QUEUE_NUM) = DNUM;
 
   // write physical addresses.
   *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
@@ -141,8 +164,8 @@ virtio_disk_init(void)
   // queue is ready.
   *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
 
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
+  // all DNUM descriptors start out unused.
+  for(int i = 0; i < DNUM; i++)
     disk.free[i] = 1;
 
   // tell device we're completely ready.
@@ -156,7 +179,7 @@ virtio_disk_init(void)
 static int
 alloc_desc()
 {
-  for(int i = 0; i < NUM; i++){
+  for(int i = 0; i < DNUM; i++){
     if(disk.free[i]){
       disk.free[i] = 0;
       return i;
@@ -169,7 +192,7 @@ alloc_desc()
 static void
 free_desc(int i)
 {
-  if(i >= NUM)
+  if(i >= DNUM)
     panic("free_desc 1");
   if(disk.free[i])
     panic("free_desc 2");
@@ -178,117 +201,165 @@ free_desc(int i)
   disk.desc[i].flags = 0;
   disk.desc[i].next = 0;
   disk.free[i] = 1;
-  wakeup(&disk.free[0]);
 }
 
-// free a chain of descriptors.
+// hand as much of the queue to the device as there are free
+// descriptors for, merging runs of consecutive blocks, and
+// notify the device once. caller must hold vdisk_lock.
 static void
-free_chain(int i)
+flush(void)
 {
-  while(1){
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
-    if(flag & VRING_DESC_F_NEXT)
-      i = nxt;
-    else
-      break;
-  }
-}
+  struct buf *b, *last;
+  int id, n, submitted = 0;
+
+  while(disk.queue && (id = alloc_desc()) >= 0){
+    b = disk.queue;
+    last = b;
+    n = 1;
+    while(n < NSEG && last->qnext && last->qnext->write == b->write &&
+          last->qnext->blockno == last->blockno + 1){
+      last = last->qnext;
+      n++;
+    }
+    disk.queue = last->qnext;
+    last->qnext = 0;
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
-static int
-alloc3_desc(int *idx)
-{
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
-    if(idx[i] < 0){
-      for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
-      return -1;
+    // the spec's Section 5.2 says that legacy block operations
+    // use a descriptor for type/reserved/sector, then the data,
+    // then a 1-byte status result. they go in the request's
+    // indirect table. qemu's virtio-blk.c reads them.
+
+    struct virtio_blk_req *buf0 = &disk.ops[id];
+    struct virtq_desc *ind = disk.ind[id];
+
+    if(b->write)
+      buf0->type = VIRTIO_BLK_T_OUT; // write the disk
+    else
+      buf0->type = VIRTIO_BLK_T_IN; // read the disk
+    buf0->reserved = 0;
+    buf0->sector = b->blockno * (BSIZE / 512);
+
+    ind[0].addr = (uint64) buf0;
+    ind[0].len = sizeof(struct virtio_blk_req);
+    ind[0].flags = VRING_DESC_F_NEXT;
+    ind[0].next = 1;
+
+    int i = 1;
+    for(struct buf *bp = b; bp; bp = bp->qnext, i++){
+      ind[i].addr = (uint64) bp->data;
+      ind[i].len = BSIZE;
+      if(b->write)
+        ind[i].flags = 0; // device reads b->data
+      else
+        ind[i].flags = VRING_DESC_F_WRITE; // device writes b->data
+      ind[i].flags |= VRING_DESC_F_NEXT;
+      ind[i].next = i + 1;
     }
+
+    disk.info[id].status = 0xff; // device writes 0 on success
+    ind[i].addr = (uint64) &disk.info[id].status;
+    ind[i].len = 1;
+    ind[i].flags = VRING_DESC_F_WRITE; // device writes the status
+    ind[i].next = 0;
+
+    disk.desc[id].addr = (uint64) ind;
+    disk.desc[id].len = (n + 2) * sizeof(struct virtq_desc);
+    disk.desc[id].flags = VRING_DESC_F_INDIRECT;
+    disk.desc[id].next = 0;
+
+    // record the bufs for virtio_disk_intr().
+    disk.info[id].b = b;
+
+    // tell the device the descriptor of our request.
+    disk.avail->ring[(disk.avail->idx + submitted) % DNUM] = id;
+    submitted++;
+    disk.nreq++;
+    disk.nbuf += n;
   }
-  return 0;
+
+  if(submitted == 0)
+    return;
+
+  __sync_synchronize();
+
+  // tell the device more avail ring entries are available.
+  disk.avail->idx += submitted; // not % DNUM ...
+
+  __sync_synchronize();
+
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  disk.nnotify++;
 }
 
+// Start a transfer of b, without waiting for it to finish:
+// call virtio_disk_wait() for that. When the transfer is done,
+// virtio_disk_intr() clears b->disk, and marks b valid if it
+// was a read.
 void
-virtio_disk_rw(struct buf *b, int write)
+virtio_disk_start(struct buf *b, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  struct buf **pp;
 
   acquire(&disk.vdisk_lock);
 
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
-
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
-
-  // format the three descriptors.
-  // qemu's virtio-blk.c reads them.
-
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
-
-  if(write)
-    buf0->type = VIRTIO_BLK_T_OUT; // write the disk
-  else
-    buf0->type = VIRTIO_BLK_T_IN; // read the disk
-  buf0->reserved = 0;
-  buf0->sector = sector;
-
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
-
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
-
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
-
-  // record struct buf for virtio_disk_intr().
   b->disk = 1;
-  disk.info[idx[0]].b = b;
-
-  // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  b->write = write;
+  for(pp = &disk.queue; *pp && (*pp)->blockno < b->blockno; pp = &(*pp)->qnext)
+    ;
+  b->qnext = *pp;
+  *pp = b;
 
-  __sync_synchronize();
+  if(disk.plugged == 0)
+    flush();
 
-  // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  release(&disk.vdisk_lock);
+}
 
-  __sync_synchronize();
+// Hold transfers back in the queue until the matching
+// virtio_disk_unplug(), so that they can be merged.
+void
+virtio_disk_plug(void)
+{
+  acquire(&disk.vdisk_lock);
+  disk.plugged++;
+  release(&disk.vdisk_lock);
+}
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+void
+virtio_disk_unplug(void)
+{
+  acquire(&disk.vdisk_lock);
+  if(--disk.plugged == 0)
+    flush();
+  release(&disk.vdisk_lock);
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
+// Wait until no transfer of b is in flight. Hands the queue
+// to the device even if it is plugged, since b may be in it.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+  if(b->disk == 1)
+    flush();
+  while(b->disk == 1)
     sleep(b, &disk.vdisk_lock);
-  }
+  release(&disk.vdisk_lock);
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_start(b, write);
+  virtio_disk_wait(b);
+}
 
-  release(&disk.vdisk_lock);
+// Print how well transfers were merged.
+void
+virtio_disk_stat(void)
+{
+  printf("disk: %d bufs in %d requests, %d notifications\n",
+         disk.nbuf, disk.nreq, disk.nnotify);
 }
 
 void
@@ -311,17 +382,29 @@ virtio_disk_intr()
 
   while(disk.used_idx != disk.used->idx){
     __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
+    int id = disk.used->ring[disk.used_idx % DNUM].id;
 
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    struct buf *b, *next;
+    for(b = disk.info[id].b; b; b = next){
+      next = b->qnext;
+      b->qnext = 0;
+      if(!b->write)
+        b->valid = 1;
+      b->disk = 0;   // disk is done with buf
+      wakeup(b);
+    }
+    disk.info[id].b = 0;
+    free_desc(id);
 
     disk.used_idx += 1;
   }
 
+  // descriptors may have come free for queued transfers.
+  if(disk.plugged == 0)
+    flush();
+
   release(&disk.vdisk_lock);
 }
@@ -5,6 +5,11 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
 
 /*
  * the kernel's page table.
@@ -36,6 +41,9 @@ kvmmake(void)
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
+  // CLINT, to program each hart's timer (see timerset()).
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // map kernel text executable and read-only.
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
@@ -168,7 +176,8 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never mapped (lazily
+// allocated memory that was never touched) are skipped.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
@@ -181,9 +190,9 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
     if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -299,40 +308,401 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, share
+// its memory in [start, end) with a child's page table.
+// Copies the page table but not the physical
+// memory: writable pages become read-only and
+// copy-on-write in both page tables, except for pages
+// of MAP_SHARED regions, and each shared page gains
+// a reference.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+uvmcopy(pagetable_t old, pagetable_t new, uint64 start, uint64 end)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+  for(i = start; i < end; i += PGSIZE){
+    // pages that were never touched stay lazy in the child too.
+    if((pte = walk(old, i, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
+    if((*pte & PTE_W) && (*pte & PTE_SHARED) == 0)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
+    kref((void*)pa);
+  }
+  // the parent's TLB may still hold writable entries.
+  sfence_vma();
+  return 0;
+
+ err:
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
+  sfence_vma();
+  return -1;
+}
+
+// Give the copy-on-write page containing va a private,
+// writable copy, or simply make it writable again if no
+// other page table still shares it.
+// Returns 0 on success, -1 if va is not a copy-on-write
+// user page or no memory is left for the copy.
+static int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+  if(krefcnt((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+  } else {
+    if((mem = kalloc()) == 0)
+      return -1;
     memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
+    *pte = PA2PTE(mem) | flags;
+    kfree((void*)pa);
+  }
+  sfence_vma();
+  return 0;
+}
+
+// Return the region of p's memory that contains va, or 0.
+static struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end != 0 && va >= v->start && va < v->end)
+      return v;
+  return 0;
+}
+
+// Map the page at va of region v, reading it in from the
+// region's file if it has one. Pages of read-only program
+// text come from and go to the page cache, so that processes
+// running the same program share them; other read-only data
+// is not cached, so that it cannot push text out.
+// Returns 0 on success, -1 on failure.
+static int
+vmafill(pagetable_t pagetable, struct vma *v, uint64 va)
+{
+  uint64 off = va - v->start;
+  int n = 0, perm, locked;
+  int cache = v->ip && (v->perm & (PTE_W|PTE_X)) == PTE_X && off < v->filesz;
+  char *mem;
+
+  // readi() sleeps, which is not allowed with a spinlock held.
+  // callers that copy user memory under a spinlock must call
+  // vmprefault() first.
+  push_off();
+  locked = mycpu()->noff > 1;
+  pop_off();
+  if(locked && v->ip)
+    return -1;
+
+  if(v->ip && off < v->filesz)
+    n = v->filesz - off < PGSIZE ? v->filesz - off : PGSIZE;
+  if(cache && (mem = (char*)pcget(v->ip, v->off + off, n)) != 0)
+    goto map;
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  if(n > 0){
+    // past the end of the file, the page stays zero.
+    ilock(v->ip);
+    if(readi(v->ip, 0, (uint64)mem, v->off + off, n) < 0){
+      iunlock(v->ip);
       kfree(mem);
-      goto err;
+      return -1;
     }
+    if(cache)
+      pcadd(v->ip, v->off + off, n, (uint64)mem);
+    iunlock(v->ip);
+  }
+
+ map:
+
+  perm = v->perm | PTE_U;
+  if(v->flags & MAP_SHARED){
+    perm |= PTE_SHARED;
+    // map a file page read-only at first, so that the
+    // first write faults and marks it dirty.
+    if(v->ip)
+      perm &= ~PTE_W;
+  }
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return -1;
   }
   return 0;
+}
 
- err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
-  return -1;
+// Handle a fault at user address va in the current process,
+// either from user space or from copyin()/copyout() on its
+// behalf. Heap pages below p->sz are only reserved by sbrk()
+// and get a zeroed page on first touch, pages of a vma are
+// read in from its file, a write to a copy-on-write page
+// gets a private copy, and a write to a page of a shared
+// file mapping marks it dirty.
+// Returns 0 if the access can be retried, -1 if it is
+// invalid or memory ran out.
+int
+vmfault(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  pte_t *pte;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if(write && (*pte & PTE_COW))
+      return uvmcow(pagetable, va);
+    if(write && (*pte & (PTE_SHARED|PTE_W)) == PTE_SHARED &&
+       p && pagetable == p->pagetable &&
+       (v = vmalookup(p, va)) != 0 && (v->perm & PTE_W)){
+      *pte |= PTE_W | PTE_D;
+      sfence_vma();
+      return 0;
+    }
+    return -1;
+  }
+
+  if(p == 0 || pagetable != p->pagetable)
+    return -1;
+  // mmap() regions lie above p->sz. exec()'s segments lie
+  // below it, and are cut off by a shrinking sbrk().
+  v = vmalookup(p, va);
+  if(va >= p->sz && (v == 0 || v->start < p->sz))
+    return -1;
+  if(v != 0){
+    if(write && (v->perm & PTE_W) == 0)
+      return -1;
+    return vmafill(pagetable, v, va);
+  }
+  // below p->sz, only the sbrk() heap above the last of
+  // exec()'s segments is zero-filled. a hole munmap() made
+  // in a segment, or a gap between two, stays unmapped.
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end != 0 && v->start < p->sz && va < v->end)
+      return -1;
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Read in every file-backed page of the current process in
+// [va, va+len) that is not mapped yet. Called before copying
+// to or from user memory with a spinlock held, since a page
+// fault then cannot sleep to read the file.
+void
+vmprefault(uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 a, end;
+
+  end = va + len;
+  if(end < va || end > MAXVA)
+    end = MAXVA;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0 || v->ip == 0)
+      continue;
+    a = PGROUNDDOWN(va) > v->start ? PGROUNDDOWN(va) : v->start;
+    for(; a < end && a < v->end; a += PGSIZE)
+      if(walkaddr(p->pagetable, a) == 0)
+        vmfault(p->pagetable, a, 0);
+  }
+}
+
+// Map whatever pages of program text region v are in the
+// page cache already, so that a program that is still in use by
+// another process starts without faulting on them.
+void
+vmaprefill(pagetable_t pagetable, struct vma *v)
+{
+  uint64 off, pa;
+  uint n;
+
+  if(v->ip == 0 || (v->perm & (PTE_W|PTE_X)) != PTE_X)
+    return;
+  for(off = 0; off < v->filesz && v->start + off < v->end; off += PGSIZE){
+    n = v->filesz - off < PGSIZE ? v->filesz - off : PGSIZE;
+    if((pa = pcget(v->ip, v->off + off, n)) == 0)
+      continue;
+    if(mappages(pagetable, v->start + off, PGSIZE, pa, v->perm|PTE_U) != 0){
+      kfree((void*)pa);
+      return;
+    }
+  }
+}
+
+// Drop the file references of n memory regions and mark them
+// unused. Must be called inside a transaction, since iput()
+// may free the inode.
+void
+vmafree(struct vma *v, int n)
+{
+  for(; n > 0; v++, n--){
+    if(v->end && v->ip)
+      iput(v->ip);
+    memset(v, 0, sizeof(*v));
+  }
+}
+
+// Write the page at va of shared file region v, whose contents
+// are at pa, back to the file. Only the part of the page that
+// lies inside the file is written: a mapping never grows it.
+static void
+vmawriteback(struct vma *v, uint64 va, uint64 pa)
+{
+  // as in filewrite(), at most log_maxop() blocks per transaction.
+  int max = ((log_maxop()-1-1-2) / 2) * BSIZE;
+  uint off = v->off + (va - v->start);
+  uint i, n;
+
+  for(i = 0; i < PGSIZE; i += n){
+    n = PGSIZE - i;
+    if(n > max)
+      n = max;
+    begin_op_n(((n + BSIZE-1) / BSIZE) * 2 + 1+1+2);
+    ilock(v->ip);
+    if(off + i >= v->ip->size){
+      iunlock(v->ip);
+      end_op();
+      break;
+    }
+    if(off + i + n > v->ip->size)
+      n = v->ip->size - off - i;
+    writei(v->ip, 0, pa + i, off + i, n);
+    iunlock(v->ip);
+    end_op();
+  }
+}
+
+// Remove [va, va+len) from p's memory regions, first writing
+// the dirty pages of shared file regions back to their files.
+// A region may shrink, be split in two, or go away. Returns 0,
+// or -1, having unmapped nothing, if a split needs a free vma
+// and there is none.
+// Must not be called inside a transaction.
+int
+vmaunmap(struct proc *p, uint64 va, uint64 len)
+{
+  struct vma *v, *nv = 0;
+  uint64 a, s, e, end;
+  int nsplit = 0;
+  pte_t *pte;
+
+  end = va + len;
+  if(end < va || end > MAXVA)
+    end = MAXVA;
+
+  // make sure there is a free vma for each split before
+  // changing anything, so that failing leaves all as it was.
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0)
+      nsplit--;
+    else if(PGROUNDDOWN(va) > v->start && PGROUNDUP(end) < v->end)
+      nsplit++;
+  }
+  if(nsplit > 0)
+    return -1;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0 || v->end <= va || v->start >= end)
+      continue;
+    s = va > v->start ? PGROUNDDOWN(va) : v->start;
+    e = end < v->end ? PGROUNDUP(end) : v->end;
+    if(s > v->start && e < v->end){
+      for(nv = p->vma; nv < &p->vma[NVMA]; nv++)
+        if(nv->end == 0)
+          break;
+    }
+
+    for(a = s; a < e; a += PGSIZE){
+      if((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+        continue;
+      if((v->flags & MAP_SHARED) && v->ip && (*pte & PTE_D))
+        vmawriteback(v, a, PTE2PA(*pte));
+      uvmunmap(p->pagetable, a, 1, 1);
+    }
+
+    if(s > v->start && e < v->end){
+      // punch a hole: the part above it becomes a new region.
+      *nv = *v;
+      nv->start = e;
+      nv->off += e - v->start;
+      nv->filesz = v->filesz > e - v->start ? v->filesz - (e - v->start) : 0;
+      if(nv->ip)
+        idup(nv->ip);
+      v->end = s;
+    } else if(s > v->start){
+      v->end = s;
+    } else if(e < v->end){
+      v->off += e - v->start;
+      v->filesz = v->filesz > e - v->start ? v->filesz - (e - v->start) : 0;
+      v->start = e;
+    } else {
+      begin_op();
+      vmafree(v, 1);
+      end_op();
+    }
+  }
+  return 0;
+}
+
+// Give np copies of p's memory regions. The pages of the
+// mmap() regions, which uvmcopy() of p->sz does not cover,
+// are shared with np the same way.
+// Returns 0 on success, -1 on failure.
+int
+vmacopy(struct proc *p, struct proc *np)
+{
+  struct vma *v;
+  int i;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0 || v->start < p->sz)
+      continue;
+    if(uvmcopy(p->pagetable, np->pagetable, v->start, v->end) < 0){
+      while(--v >= p->vma)
+        if(v->end != 0 && v->start >= p->sz)
+          uvmunmap(np->pagetable, v->start, (v->end - v->start) / PGSIZE, 1);
+      return -1;
+    }
+  }
+  for(i = 0; i < NVMA; i++){
+    np->vma[i] = p->vma[i];
+    if(np->vma[i].end && np->vma[i].ip)
+      idup(np->vma[i].ip);
+  }
+  return 0;
 }
 
 // mark a PTE invalid for user access.
@@ -355,12 +725,21 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
+  pte_t *pte;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(va0 >= MAXVA)
+      return -1;
+    pte = walk(pagetable, va0, 0);
+    if(pte == 0 || (*pte & (PTE_V|PTE_W)) != (PTE_V|PTE_W)){
+      if(vmfault(pagetable, va0, 1) < 0)
+        return -1;
+      pte = walk(pagetable, va0, 0);
+    }
+    if((*pte & (PTE_V|PTE_U|PTE_W)) != (PTE_V|PTE_U|PTE_W))
       return -1;
+    pa0 = PTE2PA(*pte);
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
@@ -384,8 +763,11 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    if(pa0 == 0){
+      if(vmfault(pagetable, va0, 0) < 0)
+        return -1;
+      pa0 = walkaddr(pagetable, va0);
+    }
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
@@ -411,8 +793,11 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    if(pa0 == 0){
+      if(vmfault(pagetable, va0, 0) < 0)
+        return -1;
+      pa0 = walkaddr(pagetable, va0);
+    }
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
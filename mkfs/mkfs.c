@@ -22,7 +22,8 @@
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog = NLOG;
+int fsflags = FS_EXTENTS|FS_DIRINDEX;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -31,6 +32,8 @@ struct superblock sb;
 char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
+struct dirent rootde[NDIRLEAF*DPB];  // the root directory's entries
+int nrootde;
 
 
 void balloc(int);
@@ -40,6 +43,8 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void rootlink(char *name, uint inum);
+void writeroot(uint rootino);
 void die(const char *);
 
 // convert to riscv byte order
@@ -69,16 +74,41 @@ int
 main(int argc, char *argv[])
 {
   int i, cc, fd;
-  uint rootino, inum, off;
-  struct dirent de;
+  uint rootino, inum;
   char buf[BSIZE];
-  struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
+  static_assert(sizeof(struct dirindex) == sizeof(struct dirent),
+                "Index entries must be dirent sized!");
+
+  while(argc >= 2 && argv[1][0] == '-'){
+    if(strcmp(argv[1], "-l") == 0 && argc >= 3){
+      nlog = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+    } else if(strcmp(argv[1], "-b") == 0){
+      // block-mapped inodes and flat directories,
+      // as in older images.
+      fsflags &= ~(FS_EXTENTS|FS_DIRINDEX);
+      argc--;
+      argv++;
+    } else {
+      argc = 0;
+      break;
+    }
+  }
 
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-l nlog] [-b] fs.img files...\n");
+    exit(1);
+  }
+
+  // the kernel needs room for a transaction of MAXOPBLOCKS
+  // blocks, and can keep track of at most LOGSIZE.
+  if(nlog < MAXOPBLOCKS+1 || nlog > LOGSIZE+1){
+    fprintf(stderr, "mkfs: nlog must be between %d and %d\n",
+            MAXOPBLOCKS+1, LOGSIZE+1);
     exit(1);
   }
 
@@ -101,6 +131,7 @@ main(int argc, char *argv[])
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.flags = xint(fsflags);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
          nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
@@ -117,15 +148,8 @@ main(int argc, char *argv[])
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  rootlink(".", rootino);
+  rootlink("..", rootino);
 
   for(i = 2; i < argc; i++){
     // get rid of "user/"
@@ -148,11 +172,7 @@ main(int argc, char *argv[])
       shortname += 1;
 
     inum = ialloc(T_FILE);
-
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    rootlink(shortname, inum);
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -160,12 +180,7 @@ main(int argc, char *argv[])
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  writeroot(rootino);
 
   balloc(freeblock);
 
@@ -249,6 +264,49 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the block holding block fbn of a file whose inode uses
+// extents. fbn may be one past the end of the file; then a new
+// block is allocated, which extends the last extent if it comes
+// right after it.
+uint
+ebmap(struct dinode *din, uint fbn)
+{
+  struct extent ext[NEXTBLOCK], *e, *prev;
+  uint i, x;
+
+  memset(ext, 0, sizeof(ext));
+  if(xint(din->extblock))
+    rsect(xint(din->extblock), (char*)ext);
+  for(i = 0; i < NEXTENT + NEXTBLOCK; i++){
+    e = i < NEXTENT ? &din->ext[i] : &ext[i - NEXTENT];
+    if(xint(e->len) == 0)
+      break;
+    if(fbn < xint(e->len))
+      return xint(e->start) + fbn;
+    fbn -= xint(e->len);
+  }
+  assert(fbn == 0 && i < NEXTENT + NEXTBLOCK);
+
+  x = freeblock++;
+  if(i > 0){
+    prev = i-1 < NEXTENT ? &din->ext[i-1] : &ext[i-1 - NEXTENT];
+    if(xint(prev->start) + xint(prev->len) == x){
+      prev->len = xint(xint(prev->len) + 1);
+      if(i-1 >= NEXTENT)
+        wsect(xint(din->extblock), (char*)ext);
+      return x;
+    }
+  }
+  if(i >= NEXTENT && xint(din->extblock) == 0)
+    din->extblock = xint(freeblock++);
+  e = i < NEXTENT ? &din->ext[i] : &ext[i - NEXTENT];
+  e->start = xint(x);
+  e->len = xint(1);
+  if(i >= NEXTENT)
+    wsect(xint(din->extblock), (char*)ext);
+  return x;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -264,13 +322,16 @@ iappend(uint inum, void *xp, int n)
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
+    if(fsflags & FS_EXTENTS){
+      x = ebmap(&din, fbn);
+    } else if(fbn < NDIRECT){
+      assert(fbn < MAXFILE);
       if(xint(din.addrs[fbn]) == 0){
         din.addrs[fbn] = xint(freeblock++);
       }
       x = xint(din.addrs[fbn]);
     } else {
+      assert(fbn < MAXFILE);
       if(xint(din.addrs[NDIRECT]) == 0){
         din.addrs[NDIRECT] = xint(freeblock++);
       }
@@ -299,3 +360,93 @@ die(const char *s)
   perror(s);
   exit(1);
 }
+
+void
+rootlink(char *name, uint inum)
+{
+  struct dirent *de;
+
+  assert(nrootde < NDIRLEAF*DPB);
+  de = &rootde[nrootde++];
+  bzero(de, sizeof(*de));
+  de->inum = xshort(inum);
+  strncpy(de->name, name, DIRSIZ);
+}
+
+// Must match dirhash() in kernel/fs.c.
+uint
+dirhash(char *name)
+{
+  uint h = 2166136261;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (unsigned char)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+int
+hashcmp(const void *a, const void *b)
+{
+  uint ha = dirhash(((struct dirent*)a)->name);
+  uint hb = dirhash(((struct dirent*)b)->name);
+
+  return ha < hb ? -1 : ha > hb;
+}
+
+// Write the root directory. If it does not fit in a block
+// and directories may be indexed, write it indexed (see
+// struct dirindex in kernel/fs.h), with the leaves half full
+// so that the kernel has room to add entries without
+// splitting them at once.
+void
+writeroot(uint rootino)
+{
+  struct dirindex ix[NDIRLEAF+1];
+  struct dirent leaf[DPB];
+  struct dinode din;
+  uint off;
+  int i, j, n;
+
+  if(nrootde <= DPB || (fsflags & FS_DIRINDEX) == 0){
+    iappend(rootino, rootde, nrootde * sizeof(struct dirent));
+
+    // fix size of root inode dir
+    rinode(rootino, &din);
+    off = xint(din.size);
+    off = ((off/BSIZE) + 1) * BSIZE;
+    din.size = xint(off);
+    winode(rootino, &din);
+    return;
+  }
+
+  qsort(rootde, nrootde, sizeof(struct dirent), hashcmp);
+
+  // cut the sorted entries into leaves, never between
+  // two entries with the same hash.
+  bzero(ix, sizeof(ix));
+  n = 0;
+  for(i = 0; i < nrootde; i = j){
+    for(j = i + 1; j < nrootde; j++)
+      if(j - i >= DPB/2 && dirhash(rootde[j].name) != dirhash(rootde[j-1].name))
+        break;
+    assert(j - i <= DPB);
+    n++;
+    assert(n <= NDIRLEAF);
+    ix[n].hash = xint(n == 1 ? 0 : dirhash(rootde[i].name));
+    ix[n].leaf = xint(n);
+  }
+  ix[0].magic = xshort(DIRMAGIC);
+  ix[0].n = xint(n);
+  iappend(rootino, ix, BSIZE);
+
+  for(i = 0; i < nrootde; i = j){
+    for(j = i + 1; j < nrootde; j++)
+      if(j - i >= DPB/2 && dirhash(rootde[j].name) != dirhash(rootde[j-1].name))
+        break;
+    bzero(leaf, sizeof(leaf));
+    memmove(leaf, &rootde[i], (j - i) * sizeof(struct dirent));
+    iappend(rootino, leaf, BSIZE);
+  }
+}
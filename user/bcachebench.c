@@ -0,0 +1,108 @@
+//
+// measure buffer cache throughput as the number of processes
+// reading in parallel grows. each worker has a file of its own,
+// small enough that all of them stay cached, and reads it over
+// and over, so that the time goes to buffer cache lookups
+// rather than to the disk. with per-bucket locks the reads
+// per millisecond of all workers together should grow with
+// the number of CPUs.
+//
+// usage: bcachebench [maxworkers]
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define FILESIZE 2048
+#define ROUNDS   500
+
+char buf[FILESIZE];
+
+void
+name(char *s, int i)
+{
+  strcpy(s, "bcbench0");
+  s[7] = '0' + i;
+}
+
+void
+worker(int i)
+{
+  char file[16];
+  int fd;
+
+  name(file, i);
+  for(int r = 0; r < ROUNDS; r++){
+    if((fd = open(file, O_RDONLY)) < 0){
+      printf("bcachebench: open %s failed\n", file);
+      exit(1);
+    }
+    if(read(fd, buf, FILESIZE) != FILESIZE){
+      printf("bcachebench: read %s failed\n", file);
+      exit(1);
+    }
+    close(fd);
+  }
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  char file[16];
+  int maxworkers = 4;
+  int fd;
+
+  if(argc > 1)
+    maxworkers = atoi(argv[1]);
+  if(maxworkers < 1 || maxworkers > 10){
+    printf("usage: bcachebench [maxworkers (1-10)]\n");
+    exit(1);
+  }
+
+  memset(buf, 'x', FILESIZE);
+  for(int i = 0; i < maxworkers; i++){
+    name(file, i);
+    if((fd = open(file, O_CREATE|O_WRONLY)) < 0 ||
+       write(fd, buf, FILESIZE) != FILESIZE){
+      printf("bcachebench: create %s failed\n", file);
+      exit(1);
+    }
+    close(fd);
+  }
+
+  for(int n = 1; n <= maxworkers; n++){
+    uint64 start = uptimeus();
+    for(int i = 0; i < n; i++){
+      int pid = fork();
+      if(pid < 0){
+        printf("bcachebench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0)
+        worker(i);
+    }
+    int failed = 0;
+    for(int i = 0; i < n; i++){
+      int xstatus;
+      wait(&xstatus);
+      if(xstatus != 0)
+        failed = 1;
+    }
+    if(failed)
+      exit(1);
+    uint64 us = uptimeus() - start;
+    if(us == 0)
+      us = 1;
+    printf("bcachebench: %d workers, %d reads each: %d us per read, %d reads/ms in all\n",
+           n, ROUNDS, (int)(us / ROUNDS), (int)((uint64)n * ROUNDS * 1000 / us));
+  }
+
+  for(int i = 0; i < maxworkers; i++){
+    name(file, i);
+    unlink(file);
+  }
+  exit(0);
+}
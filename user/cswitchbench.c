@@ -0,0 +1,110 @@
+//
+// measure context switch cost as the number of processes
+// grows. two processes pass a byte back and forth over a pair
+// of pipes, so that every round trip is two sleeps, two
+// wakeups and two switches, while more and more idle
+// processes sit blocked on a pipe that is never written. the
+// time per round trip should not depend on how many idle
+// processes there are.
+//
+// usage: cswitchbench [maxidle]
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define ROUNDS 2000
+#define STEP   8
+
+// ping-pong ROUNDS bytes with a child; return the
+// microseconds per round trip.
+int
+pingpong(void)
+{
+  int ab[2], ba[2];
+  char c = 'x';
+
+  if(pipe(ab) < 0 || pipe(ba) < 0){
+    printf("cswitchbench: pipe failed\n");
+    exit(1);
+  }
+  int pid = fork();
+  if(pid < 0){
+    printf("cswitchbench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(ab[1]);
+    close(ba[0]);
+    while(read(ab[0], &c, 1) == 1)
+      write(ba[1], &c, 1);
+    exit(0);
+  }
+  close(ab[0]);
+  close(ba[1]);
+
+  uint64 start = uptimeus();
+  for(int r = 0; r < ROUNDS; r++){
+    if(write(ab[1], &c, 1) != 1 || read(ba[0], &c, 1) != 1){
+      printf("cswitchbench: ping-pong failed\n");
+      exit(1);
+    }
+  }
+  uint64 elapsed = uptimeus() - start;
+
+  close(ab[1]);
+  close(ba[0]);
+  wait(0);
+  return elapsed / ROUNDS;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int maxidle = 48;
+  int idle[2];
+  int nidle = 0;
+
+  if(argc > 1)
+    maxidle = atoi(argv[1]);
+  if(maxidle < 0){
+    printf("usage: cswitchbench [maxidle]\n");
+    exit(1);
+  }
+
+  // the idle processes block reading idle[0] until
+  // we close idle[1] at the end.
+  if(pipe(idle) < 0){
+    printf("cswitchbench: pipe failed\n");
+    exit(1);
+  }
+
+  for(;;){
+    printf("cswitchbench: %d idle processes, %d us per round trip\n",
+           nidle, pingpong());
+    if(nidle >= maxidle)
+      break;
+    for(int i = 0; i < STEP && nidle < maxidle; i++){
+      int pid = fork();
+      if(pid < 0){
+        printf("cswitchbench: fork failed, stopping at %d\n", nidle);
+        maxidle = nidle;
+        break;
+      }
+      if(pid == 0){
+        char c;
+        close(idle[1]);
+        read(idle[0], &c, 1);
+        exit(0);
+      }
+      nidle++;
+    }
+  }
+
+  close(idle[1]);
+  close(idle[0]);
+  while(nidle-- > 0)
+    wait(0);
+  exit(0);
+}
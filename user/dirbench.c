@@ -0,0 +1,110 @@
+//
+// measure directory operations as a directory grows. adds
+// links to one file under many names, in steps, and after
+// each step reports the time per link and the time per
+// lookup of every name so far. on a file system with
+// indexed directories a lookup reads two blocks however big
+// the directory is, so the times should stay flat; a flat
+// directory is scanned.
+//
+// usage: dirbench [nfiles]
+//
+// an indexed directory holds at most NDIRLEAF*DPB entries, and
+// fewer if its names hash unevenly; dirbench stops at the first
+// link that fails and reports how far it got.
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "user/user.h"
+
+#define DIR  "dirbench.d"
+#define STEP 500
+
+void
+name(char *s, int i)
+{
+  strcpy(s, DIR "/x0000");
+  s[sizeof(DIR)+1] = '0' + i / 1000 % 10;
+  s[sizeof(DIR)+2] = '0' + i / 100 % 10;
+  s[sizeof(DIR)+3] = '0' + i / 10 % 10;
+  s[sizeof(DIR)+4] = '0' + i % 10;
+}
+
+int
+main(int argc, char *argv[])
+{
+  char file[32], target[32];
+  int nfiles = 2000;
+  int fd, n, max;
+
+  max = NDIRLEAF * DPB;
+  if(max > 9999)
+    max = 9999;
+  if(argc > 1)
+    nfiles = atoi(argv[1]);
+  if(nfiles < 1 || nfiles > max){
+    printf("usage: dirbench [nfiles (1-%d)]\n", max);
+    exit(1);
+  }
+
+  if(mkdir(DIR) < 0){
+    printf("dirbench: mkdir %s failed\n", DIR);
+    exit(1);
+  }
+  strcpy(target, DIR "/target");
+  if((fd = open(target, O_CREATE|O_WRONLY)) < 0){
+    printf("dirbench: create %s failed\n", target);
+    exit(1);
+  }
+  close(fd);
+
+  for(n = 0; n < nfiles; ){
+    int step = nfiles - n < STEP ? nfiles - n : STEP;
+
+    uint64 start = uptimeus();
+    for(int i = n; i < n + step; i++){
+      name(file, i);
+      if(link(target, file) < 0){
+        printf("dirbench: link %s failed; directory full after %d entries\n",
+               file, i);
+        nfiles = i;
+        step = i - n;
+        break;
+      }
+    }
+    uint64 created = uptimeus() - start;
+    if(step == 0)
+      break;
+    n += step;
+
+    start = uptimeus();
+    for(int i = 0; i < n; i++){
+      struct stat st;
+      name(file, i);
+      if(stat(file, &st) < 0){
+        printf("dirbench: stat %s failed\n", file);
+        exit(1);
+      }
+    }
+    printf("dirbench: %d entries: %d us per link, %d us per lookup\n",
+           n, (int)(created / step), (int)((uptimeus() - start) / n));
+  }
+
+  uint64 start = uptimeus();
+  for(int i = 0; i < nfiles; i++){
+    name(file, i);
+    if(unlink(file) < 0){
+      printf("dirbench: unlink %s failed\n", file);
+      exit(1);
+    }
+  }
+  printf("dirbench: %d entries: %d us per unlink\n",
+         nfiles, (int)((uptimeus() - start) / nfiles));
+
+  unlink(target);
+  unlink(DIR);
+  exit(0);
+}
@@ -0,0 +1,63 @@
+//
+// measure fork()+exec() latency as the size of the
+// forking process grows. the child immediately execs
+// this program again, which exits at once, the way
+// sh's runcmd forks and then execs a command. with
+// copy-on-write fork and demand-paged exec, the time
+// per fork+exec should hardly grow with the heap.
+//
+// usage: forkexecbench
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/riscv.h"
+
+#define ROUNDS 100
+
+char *childargv[] = { "forkexecbench", "-child", 0 };
+
+int
+main(int argc, char *argv[])
+{
+  static int sizes[] = { 0, 256, 1024, 4096 }; // extra heap, in pages
+  int grown = 0;
+
+  if(argc > 1 && strcmp(argv[1], "-child") == 0)
+    exit(0);
+
+  for(int s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++){
+    int npages = sizes[s] - grown;
+    char *a = sbrk(npages*PGSIZE);
+    if(a == (char*)-1){
+      printf("forkexecbench: sbrk failed\n");
+      exit(1);
+    }
+    // touch the new memory so that it is really there.
+    for(int i = 0; i < npages; i++)
+      a[i*PGSIZE] = 1;
+    grown = sizes[s];
+
+    uint64 start = uptimeus();
+    for(int r = 0; r < ROUNDS; r++){
+      int pid = fork();
+      if(pid < 0){
+        printf("forkexecbench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0){
+        exec(childargv[0], childargv);
+        printf("forkexecbench: exec failed\n");
+        exit(1);
+      }
+      int xstatus;
+      wait(&xstatus);
+      if(xstatus != 0)
+        exit(1);
+    }
+    printf("forkexecbench: %d KB heap, %d us per fork+exec\n",
+           grown*PGSIZE/1024, (int)((uptimeus() - start) / ROUNDS));
+  }
+  exit(0);
+}
@@ -3,29 +3,52 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "user/user.h"
+#include "kernel/fcntl.h"
 
 char buf[1024];
 int match(char*, char*);
 
+// Print the complete lines of the string p that match
+// pattern. Returns a pointer past the last complete line.
+char*
+grepline(char *pattern, char *p)
+{
+  char *q;
+
+  while((q = strchr(p, '\n')) != 0){
+    *q = 0;
+    if(match(pattern, p)){
+      *q = '\n';
+      write(1, p, q+1 - p);
+    }
+    p = q+1;
+  }
+  return p;
+}
+
 void
 grep(char *pattern, int fd)
 {
   int n, m;
-  char *p, *q;
+  char *p;
+  struct stat st;
+
+  // match a file where it is mapped, rather than copying it
+  // through buf. the mapping is private so that lines can be
+  // terminated in place, and one byte longer than the file,
+  // which reads as the terminating zero.
+  if(fstat(fd, &st) == 0 && st.type == T_FILE && st.size > 0 &&
+     (p = mmap(0, st.size + 1, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0)) != (char*)-1){
+    grepline(pattern, p);
+    munmap(p, st.size + 1);
+    return;
+  }
 
   m = 0;
   while((n = read(fd, buf+m, sizeof(buf)-m-1)) > 0){
     m += n;
     buf[m] = '\0';
-    p = buf;
-    while((q = strchr(p, '\n')) != 0){
-      *q = 0;
-      if(match(pattern, p)){
-        *q = '\n';
-        write(1, p, q+1 - p);
-      }
-      p = q+1;
-    }
+    p = grepline(pattern, buf);
     if(m > 0){
       m -= p - buf;
       memmove(buf, p, m);
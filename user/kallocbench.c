@@ -0,0 +1,81 @@
+//
+// measure the cost of kalloc()/kfree() as the number of
+// processes allocating physical pages in parallel grows.
+// each worker repeatedly grows its heap by NPAGE pages,
+// touches every page, and shrinks it again, so that each
+// page costs a page fault, a kalloc() and a kfree(). with
+// per-CPU free lists the cost per page should stay flat up
+// to the number of CPUs, and the pages per millisecond of
+// all workers together should grow with them.
+//
+// usage: kallocbench [maxworkers]
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/riscv.h"
+
+#define NPAGE  64
+#define ROUNDS 200
+
+void
+worker(void)
+{
+  for(int r = 0; r < ROUNDS; r++){
+    char *a = sbrk(NPAGE*PGSIZE);
+    if(a == (char*)-1){
+      printf("kallocbench: sbrk failed\n");
+      exit(1);
+    }
+    for(int i = 0; i < NPAGE; i++)
+      a[i*PGSIZE] = r;
+    if(sbrk(-NPAGE*PGSIZE) == (char*)-1){
+      printf("kallocbench: sbrk shrink failed\n");
+      exit(1);
+    }
+  }
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int maxworkers = 4;
+
+  if(argc > 1)
+    maxworkers = atoi(argv[1]);
+  if(maxworkers < 1){
+    printf("usage: kallocbench [maxworkers]\n");
+    exit(1);
+  }
+
+  for(int n = 1; n <= maxworkers; n++){
+    uint64 start = uptimeus();
+    for(int i = 0; i < n; i++){
+      int pid = fork();
+      if(pid < 0){
+        printf("kallocbench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0)
+        worker();
+    }
+    int failed = 0;
+    for(int i = 0; i < n; i++){
+      int xstatus;
+      wait(&xstatus);
+      if(xstatus != 0)
+        failed = 1;
+    }
+    if(failed)
+      exit(1);
+    uint64 us = uptimeus() - start;
+    if(us == 0)
+      us = 1;
+    printf("kallocbench: %d workers, %d pages each: %d ns per page, %d pages/ms in all\n",
+           n, ROUNDS*NPAGE, (int)(us * 1000 / (ROUNDS*NPAGE)),
+           (int)((uint64)n * ROUNDS*NPAGE * 1000 / us));
+  }
+  exit(0);
+}
@@ -0,0 +1,96 @@
+//
+// measure how quickly an interactive process gets the CPU
+// while CPU-bound processes keep every CPU busy. the probe
+// sleeps until the next tick, NSLEEP times; the time from
+// that tick until it runs again is its wakeup latency, and
+// is reported as the mean and the worst case. the probe runs
+// as an ordinary process, against hogs at the lowest
+// priority, and as a SCHED_FIFO process.
+//
+// usage: latbench [nhogs]
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/sched.h"
+#include "user/user.h"
+
+#define NSLEEP 20
+#define MAXHOGS 32
+#define TICKUS 100000  // microseconds per tick
+
+int hogs[MAXHOGS];
+
+void
+starthogs(int n, int nice)
+{
+  for(int i = 0; i < n; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("latbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      setpriority(0, SCHED_FAIR, nice);
+      for(volatile uint x = 0; ; x++)
+        ;
+    }
+    hogs[i] = pid;
+  }
+}
+
+void
+stophogs(int n)
+{
+  for(int i = 0; i < n; i++)
+    kill(hogs[i]);
+  for(int i = 0; i < n; i++)
+    wait(0);
+}
+
+void
+probe(char *what, int nhogs, int hognice, int policy, int prio)
+{
+  if(setpriority(0, policy, prio) < 0){
+    printf("latbench: setpriority failed\n");
+    exit(1);
+  }
+  starthogs(nhogs, hognice);
+  sleep(1);  // line up with a tick
+
+  uint64 total = 0, worst = 0;
+  for(int i = 0; i < NSLEEP; i++){
+    // sleep(1) wakes at the start of the next tick.
+    uint64 due = (uptimeus() / TICKUS + 1) * TICKUS;
+    sleep(1);
+    uint64 now = uptimeus();
+    uint64 lat = now > due ? now - due : 0;
+    total += lat;
+    if(lat > worst)
+      worst = lat;
+  }
+
+  stophogs(nhogs);
+  setpriority(0, SCHED_FAIR, 0);
+  printf("latbench: %s, %d hogs: wakeup latency %d us mean, %d us worst\n",
+         what, nhogs, (int)(total / NSLEEP), (int)worst);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nhogs = 8;
+
+  if(argc > 1)
+    nhogs = atoi(argv[1]);
+  if(nhogs < 0 || nhogs > MAXHOGS){
+    printf("usage: latbench [nhogs (0-%d)]\n", MAXHOGS);
+    exit(1);
+  }
+
+  probe("idle", 0, 0, SCHED_FAIR, 0);
+  probe("fair", nhogs, 0, SCHED_FAIR, 0);
+  probe("fair, hogs at nice 19", nhogs, NICE_MAX, SCHED_FAIR, 0);
+  probe("fifo", nhogs, 0, SCHED_FIFO, 1);
+  exit(0);
+}
@@ -23,6 +23,14 @@ char* sbrk(int);
 int sleep(int);
 int uptime(void);
 ushort opendfd(void);
+void* mmap(void*, uint64, int, int, int, uint64);
+int munmap(void*, uint64);
+int setpriority(int, int, int);
+int getpriority(int, int*);
+int sched_setaffinity(int, int);
+int sched_getaffinity(int);
+int sched_getcpu(void);
+uint64 uptimeus(void);
 
 // ulib.c
 int stat(const char*, struct stat*);
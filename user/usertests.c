@@ -629,6 +629,54 @@ writebig(char *s)
   }
 }
 
+// a file larger than MAXFILE, which the extent
+// format allows.
+void
+extentbig(char *s)
+{
+  enum { N = MAXFILE + 100 };
+  int i, fd;
+
+  fd = open("extbig", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create extbig failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    ((int*)buf)[0] = i;
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write extbig block %d failed\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  fd = open("extbig", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open extbig failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(read(fd, buf, BSIZE) != BSIZE){
+      printf("%s: read extbig block %d failed\n", s, i);
+      exit(1);
+    }
+    if(((int*)buf)[0] != i){
+      printf("%s: extbig block %d holds %d\n", s, i, ((int*)buf)[0]);
+      exit(1);
+    }
+  }
+  if(read(fd, buf, BSIZE) != 0){
+    printf("%s: extbig too long\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(unlink("extbig") < 0){
+    printf("%s: unlink extbig failed\n", s);
+    exit(1);
+  }
+}
+
 // many creates, followed by unlink test
 void
 createtest(char *s)
@@ -815,6 +863,94 @@ killstatus(char *s)
   exit(0);
 }
 
+// pin to CPU 0 and back. a forked child inherits the mask.
+void
+affinity(char *s)
+{
+  int old, xstatus;
+
+  old = sched_getaffinity(0);
+  if(old <= 0){
+    printf("%s: sched_getaffinity failed\n", s);
+    exit(1);
+  }
+  if(sched_setaffinity(0, 0) != -1){
+    printf("%s: sched_setaffinity accepted an empty mask\n", s);
+    exit(1);
+  }
+  if(sched_getaffinity(0x7fffffff) != -1){
+    printf("%s: sched_getaffinity of no process succeeded\n", s);
+    exit(1);
+  }
+  if(sched_setaffinity(0, 1) != 0 || sched_getaffinity(0) != 1){
+    printf("%s: pinning to CPU 0 failed\n", s);
+    exit(1);
+  }
+  sleep(1);  // go through the scheduler pinned
+
+  int pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(sched_getaffinity(0) == 1 ? 0 : 1);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child did not inherit the mask\n", s);
+    exit(1);
+  }
+
+  if(sched_setaffinity(0, old) != 0){
+    printf("%s: unpinning failed\n", s);
+    exit(1);
+  }
+}
+
+// start two CPU-bound processes on CPU 0 while other CPUs
+// are idle. one of them should move, even though it is
+// cache-hot every time an idle CPU looks at it.
+void
+migrate(char *s)
+{
+  int old, start, xstatus, seen = 0;
+
+  old = sched_getaffinity(0);
+  if(sched_setaffinity(0, 2) != 0)
+    return;  // only one CPU
+  if(sched_setaffinity(0, 1) != 0){
+    printf("%s: pinning to CPU 0 failed\n", s);
+    exit(1);
+  }
+  sleep(1);  // get to CPU 0
+
+  start = uptime();
+  for(int i = 0; i < 2; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      // queued on CPU 0, but free to move.
+      int cpus = 0;
+      sched_setaffinity(0, old);
+      while(uptime() < start + 20)
+        cpus |= 1 << sched_getcpu();
+      exit(cpus);
+    }
+  }
+  sched_setaffinity(0, old);
+  for(int i = 0; i < 2; i++){
+    wait(&xstatus);
+    seen |= xstatus;
+  }
+  if((seen & ~1) == 0){
+    printf("%s: neither process left CPU 0\n", s);
+    exit(1);
+  }
+}
+
 // meant to be run w/ at most two CPUs
 void
 preempt(char *s)
@@ -2544,6 +2680,156 @@ sbrklast(char *s)
 }
 
 
+// exec() leaves program pages to be read in from the file on
+// first touch. check that this works when the kernel touches
+// them on the program's behalf: read the program file into its
+// own bss, and send some of its text through a pipe.
+void
+lazyexec(char *s)
+{
+  static char buf[2*4096];
+  char text[64];
+  int fd, fds[2];
+
+  fd = open("usertests", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open usertests failed\n", s);
+    exit(1);
+  }
+  if(read(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf("%s: read usertests failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(buf[0] != 0x7f || buf[1] != 'E' || buf[2] != 'L' || buf[3] != 'F'){
+    printf("%s: bad ELF header\n", s);
+    exit(1);
+  }
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], (char*)lazyexec, sizeof(text)) != sizeof(text)){
+    printf("%s: write text failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], text, sizeof(text)) != sizeof(text)){
+    printf("%s: read text failed\n", s);
+    exit(1);
+  }
+  if(memcmp(text, (char*)lazyexec, sizeof(text)) != 0){
+    printf("%s: text mismatch\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// mmap() of a file, shared and private, and anonymous
+// memory shared with a child.
+void
+mmaptest(char *s)
+{
+  char *p, *q;
+  int fd, i, pid, xstatus;
+  static char buf[2*4096 + 100];
+
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = 'a' + i % 26;
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf("%s: create mmapfile failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, sizeof(buf), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  q = mmap(0, sizeof(buf), PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1 || q == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(memcmp(p, buf, sizeof(buf)) != 0 || memcmp(q, buf, sizeof(buf)) != 0){
+    printf("%s: mapped contents differ from file\n", s);
+    exit(1);
+  }
+  // the page past the end of the file reads as zeros.
+  if(p[sizeof(buf)] != 0){
+    printf("%s: no zero past end of file\n", s);
+    exit(1);
+  }
+  p[0] = 'X';
+  p[4096 + 1] = 'Y';
+  q[2] = 'Z';
+  if(munmap(p, sizeof(buf)) < 0 || munmap(q, sizeof(buf)) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmapfile", O_RDONLY);
+  if(fd < 0 || read(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf("%s: reopen mmapfile failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(buf[0] != 'X' || buf[4096 + 1] != 'Y' || buf[2] != 'c'){
+    printf("%s: wrong write-back\n", s);
+    exit(1);
+  }
+  unlink("mmapfile");
+
+  p = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if(p == (char*)-1 || p[0] != 0){
+    printf("%s: anonymous mmap failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    p[0] = 'c';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[0] != 'c'){
+    printf("%s: child's write to shared memory lost\n", s);
+    exit(1);
+  }
+  munmap(p, 4096);
+
+  // touching unmapped memory must kill the process.
+  pid = fork();
+  if(pid == 0){
+    p[0] = 1;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: access after munmap succeeded\n", s);
+    exit(1);
+  }
+
+  // so must touching a page of text that was unmapped; it
+  // must not come back as a page of zeros. the first page
+  // holds usertests.c's first functions, which the child
+  // does not run.
+  pid = fork();
+  if(pid == 0){
+    if(munmap(0, 4096) < 0)
+      exit(1);
+    xstatus = *(volatile char*)0;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: access to unmapped text succeeded\n", s);
+    exit(1);
+  }
+}
+
 // does sbrk handle signed int32 wrap-around with
 // negative arguments?
 void
@@ -2590,12 +2876,15 @@ struct test {
   {opentest, "opentest"},
   {writetest, "writetest"},
   {writebig, "writebig"},
+  {extentbig, "extentbig"},
   {createtest, "createtest"},
   {dirtest, "dirtest"},
   {exectest, "exectest"},
   {pipe1, "pipe1"},
   {killstatus, "killstatus"},
   {preempt, "preempt"},
+  {affinity, "affinity"},
+  {migrate, "migrate"},
   {exitwait, "exitwait"},
   {reparent, "reparent" },
   {twochildren, "twochildren"},
@@ -2634,6 +2923,8 @@ struct test {
   {sbrkbugs, "sbrkbugs" },
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
+  {lazyexec, "lazyexec"},
+  {mmaptest, "mmap"},
   {badarg, "badarg" },
 
   { 0, 0},
@@ -2812,6 +3103,56 @@ execout(char *s)
   exit(0);
 }
 
+// how long does it take to fill the disk, with one
+// writer and with four writing at the same time?
+// reports the ticks each took.
+void
+fillbench(char *s)
+{
+  enum { NW = 4 };
+  char name[8];
+  int start, n, w, xstatus;
+
+  for(int nw = 1; nw <= NW; nw *= NW){
+    start = uptime();
+    for(w = 0; w < nw; w++){
+      int pid = fork();
+      if(pid < 0){
+        printf("%s: fork failed\n", s);
+        exit(1);
+      }
+      if(pid == 0){
+        strcpy(name, "fill0");
+        name[4] = '0' + w;
+        int fd = open(name, O_CREATE|O_WRONLY|O_TRUNC);
+        if(fd < 0){
+          printf("%s: create %s failed\n", s, name);
+          exit(1);
+        }
+        for(n = 0; write(fd, buf, BSIZE) == BSIZE; n++)
+          ;
+        close(fd);
+        exit(n > 0 ? 0 : 1);
+      }
+    }
+    int failed = 0;
+    for(w = 0; w < nw; w++){
+      wait(&xstatus);
+      if(xstatus != 0)
+        failed = 1;
+    }
+    printf("%s: %d writers filled the disk in %d ticks\n",
+           s, nw, uptime() - start);
+    for(w = 0; w < nw; w++){
+      strcpy(name, "fill0");
+      name[4] = '0' + w;
+      unlink(name);
+    }
+    if(failed)
+      exit(1);
+  }
+}
+
 // can the kernel tolerate running out of disk space?
 void
 diskfull(char *s)
@@ -2930,6 +3271,7 @@ struct test slowtests[] = {
   {badwrite, "badwrite" },
   {execout, "execout"},
   {diskfull, "diskfull"},
+  {fillbench, "fillbench"},
   {outofinodes, "outofinodes"},
     
   { 0, 0},
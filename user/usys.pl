@@ -36,3 +36,11 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("mmap");
+entry("munmap");
+entry("setpriority");
+entry("getpriority");
+entry("sched_setaffinity");
+entry("sched_getaffinity");
+entry("sched_getcpu");
+entry("uptimeus");